@@ -0,0 +1,148 @@
+/*
+ * libpurple-translate
+ * Copyright (C) 2010  Eion Robb
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef PURPLE_TRANSLATE_PHRASES_H
+#define PURPLE_TRANSLATE_PHRASES_H
+
+#include <glib.h>
+#include <string.h>
+
+/** The offline phrase table, shared by the plugin and purple-translate-phrasetable.
+  * The file is [magic][record count][record offsets][records], each offset a
+  * little-endian uint32 from the start of the file and the offsets sorted by the
+  * strcmp() order of their keys, so the table can be binary searched straight out
+  * of a memory mapping.  Each record is "from\tto\tphrase\0translation\0" */
+#define TRANSLATE_PHRASES_MAGIC "PTPT0001"
+#define TRANSLATE_PHRASES_MAGIC_LEN 8
+#define TRANSLATE_PHRASES_HEADER_LEN 12
+
+static gchar *
+translate_phrases_make_key(const gchar *from_lang, const gchar *to_lang, const gchar *phrase)
+{
+	return g_strconcat(from_lang, "\t", to_lang, "\t", phrase, NULL);
+}
+
+/** Whether c is punctuation that doesn't change what a short phrase means */
+static gboolean
+translate_phrases_is_trailing(gunichar c)
+{
+	return c == '.' || c == '!' || c == '?' || c == ',' || c == ';' || c == ':' ||
+		c == 0x2026 || c == 0x3002 || c == 0xFF01 || c == 0xFF1F || g_unichar_isspace(c);
+}
+
+/** The form a phrase is looked up by when it doesn't match exactly: lower case,
+  * whitespace collapsed and trailing punctuation dropped, so that "Hello!",
+  * "hello." and "  hello" are all the same phrase */
+static gchar *
+translate_phrases_normalize(const gchar *phrase)
+{
+	GString *normal;
+	const gchar *pos, *last;
+	gboolean space = FALSE;
+	gunichar c;
+
+	normal = g_string_sized_new(strlen(phrase));
+	for(pos = phrase; *pos; pos = g_utf8_next_char(pos))
+	{
+		c = g_utf8_get_char(pos);
+		if (g_unichar_isspace(c))
+		{
+			space = normal->len > 0;
+			continue;
+		}
+		if (space)
+			g_string_append_c(normal, ' ');
+		space = FALSE;
+		g_string_append_unichar(normal, g_unichar_tolower(c));
+	}
+
+	while (normal->len)
+	{
+		last = g_utf8_find_prev_char(normal->str, normal->str + normal->len);
+		if (last == NULL || !translate_phrases_is_trailing(g_utf8_get_char(last)))
+			break;
+		g_string_truncate(normal, last - normal->str);
+	}
+
+	return g_string_free(normal, FALSE);
+}
+
+static guint32
+translate_phrases_read_uint32(const gchar *data)
+{
+	guint32 value;
+	
+	memcpy(&value, data, sizeof(value));
+	return GUINT32_FROM_LE(value);
+}
+
+/** How many records the table in data holds, or 0 if it isn't a table we can read */
+static guint32
+translate_phrases_count_records(const gchar *data, gsize length)
+{
+	guint32 count;
+	
+	if (length <= TRANSLATE_PHRASES_HEADER_LEN || memcmp(data, TRANSLATE_PHRASES_MAGIC, TRANSLATE_PHRASES_MAGIC_LEN) != 0)
+		return 0;
+	count = translate_phrases_read_uint32(data + TRANSLATE_PHRASES_MAGIC_LEN);
+	
+	// Every record ends in a nul, so as long as the last byte is one no key can run off the end
+	if (data[length - 1] != '\0' || count > (length - TRANSLATE_PHRASES_HEADER_LEN) / sizeof(guint32))
+		return 0;
+	
+	return count;
+}
+
+/** Binary searches the table in data (of count records) for key ("from\tto\tphrase"),
+  * returning its translation or NULL */
+static const gchar *
+translate_phrases_search(const gchar *data, gsize length, guint32 count, const gchar *key)
+{
+	const gchar *record;
+	gsize first;
+	guint32 low = 0, high = count, middle, offset;
+	gint cmp;
+	
+	first = TRANSLATE_PHRASES_HEADER_LEN + count * sizeof(guint32);
+	
+	while (low < high)
+	{
+		middle = low + (high - low) / 2;
+		offset = translate_phrases_read_uint32(data + TRANSLATE_PHRASES_HEADER_LEN + middle * sizeof(guint32));
+		if (offset < first || offset >= length)
+			return NULL;
+		
+		record = data + offset;
+		cmp = strcmp(key, record);
+		if (cmp == 0)
+		{
+			record += strlen(record) + 1;
+			return (record < data + length) ? record : NULL;
+		}
+		if (cmp < 0)
+			high = middle;
+		else
+			low = middle + 1;
+	}
+	
+	return NULL;
+}
+
+#endif /* PURPLE_TRANSLATE_PHRASES_H */
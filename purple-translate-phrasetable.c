@@ -0,0 +1,324 @@
+/*
+ * libpurple-translate
+ * Copyright (C) 2010  Eion Robb
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/*
+ * Builds the offline phrase table the plugin looks phrases up in from TSV
+ * phrase lists, one phrase a line:
+ *
+ *     from<TAB>to<TAB>phrase<TAB>translation
+ *
+ * using the plugin's language codes (eg. "en", "zh-CN").  Blank lines and lines
+ * starting with # are skipped, and a later line for the same phrase wins.
+ * Copy the result to translate-phrases.db in the purple user directory.
+ *
+ *     purple-translate-phrasetable --check TABLE.db LOOKUPS.tsv
+ *
+ * looks phrases up in a built table the way the plugin does, as written and then
+ * normalized, one lookup a line:
+ *
+ *     from<TAB>to<TAB>phrase<TAB>expected translation, or - for none
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "purple-translate-phrases.h"
+
+/** A phrase to go in the table */
+typedef struct {
+	gchar *translation;
+	gboolean exact; //as written, rather than only the normalized form of it
+} PhraseTableEntry;
+
+static void
+phrasetable_entry_free(gpointer data)
+{
+	PhraseTableEntry *entry = data;
+
+	g_free(entry->translation);
+	g_free(entry);
+}
+
+static void
+phrasetable_add(GHashTable *entries, gchar *key, const gchar *translation, gboolean exact)
+{
+	PhraseTableEntry *entry;
+
+	// A phrase that was written that way beats one that only normalizes to it
+	entry = g_hash_table_lookup(entries, key);
+	if (entry != NULL && entry->exact && !exact)
+	{
+		g_free(key);
+		return;
+	}
+
+	entry = g_new0(PhraseTableEntry, 1);
+	entry->translation = g_strdup(translation);
+	entry->exact = exact;
+	g_hash_table_replace(entries, key, entry);
+}
+
+static gboolean
+phrasetable_read(GHashTable *entries, const gchar *filename)
+{
+	gchar *contents, **lines, **fields;
+	gchar *normal;
+	GError *error = NULL;
+	guint i, count = 0;
+
+	if (!g_file_get_contents(filename, &contents, NULL, &error))
+	{
+		fprintf(stderr, "Could not read %s: %s\n", filename, error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+
+	if (!g_utf8_validate(contents, -1, NULL))
+	{
+		fprintf(stderr, "%s is not UTF-8\n", filename);
+		g_free(contents);
+		return FALSE;
+	}
+
+	lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+
+	for(i = 0; lines[i]; i++)
+	{
+		g_strchomp(lines[i]);
+		if (lines[i][0] == '\0' || lines[i][0] == '#')
+			continue;
+
+		fields = g_strsplit(lines[i], "\t", 4);
+		if (g_strv_length(fields) != 4 || !*fields[0] || !*fields[1] || !*fields[2] || !*fields[3])
+		{
+			fprintf(stderr, "%s:%u: expected from, to, phrase and translation separated by tabs\n", filename, i + 1);
+			g_strfreev(fields);
+			continue;
+		}
+
+		phrasetable_add(entries, translate_phrases_make_key(fields[0], fields[1], fields[2]), fields[3], TRUE);
+
+		normal = translate_phrases_normalize(fields[2]);
+		if (*normal && !g_str_equal(normal, fields[2]))
+			phrasetable_add(entries, translate_phrases_make_key(fields[0], fields[1], normal), fields[3], FALSE);
+		g_free(normal);
+
+		g_strfreev(fields);
+		count++;
+	}
+
+	g_strfreev(lines);
+
+	printf("%s: %u phrases\n", filename, count);
+
+	return TRUE;
+}
+
+static gint
+phrasetable_compare_keys(gconstpointer a, gconstpointer b)
+{
+	return strcmp(*(const gchar **) a, *(const gchar **) b);
+}
+
+static gboolean
+phrasetable_write(GHashTable *entries, const gchar *filename)
+{
+	GPtrArray *keys;
+	GHashTableIter iter;
+	gpointer key;
+	PhraseTableEntry *entry;
+	FILE *file;
+	gchar *temp_filename;
+	guint32 value, offset;
+	guint i;
+	gboolean success;
+
+	keys = g_ptr_array_sized_new(g_hash_table_size(entries));
+	g_hash_table_iter_init(&iter, entries);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		g_ptr_array_add(keys, key);
+	g_ptr_array_sort(keys, phrasetable_compare_keys);
+
+	temp_filename = g_strdup_printf("%s.tmp", filename);
+	file = g_fopen(temp_filename, "wb");
+	if (file == NULL)
+	{
+		fprintf(stderr, "Could not write %s\n", temp_filename);
+		g_ptr_array_free(keys, TRUE);
+		g_free(temp_filename);
+		return FALSE;
+	}
+
+	value = GUINT32_TO_LE(keys->len);
+	success = fwrite(TRANSLATE_PHRASES_MAGIC, TRANSLATE_PHRASES_MAGIC_LEN, 1, file) == 1 &&
+			fwrite(&value, sizeof(value), 1, file) == 1;
+
+	offset = TRANSLATE_PHRASES_HEADER_LEN + keys->len * sizeof(guint32);
+	for(i = 0; success && i < keys->len; i++)
+	{
+		entry = g_hash_table_lookup(entries, g_ptr_array_index(keys, i));
+		value = GUINT32_TO_LE(offset);
+		success = fwrite(&value, sizeof(value), 1, file) == 1;
+		offset += strlen(g_ptr_array_index(keys, i)) + 1 + strlen(entry->translation) + 1;
+	}
+
+	for(i = 0; success && i < keys->len; i++)
+	{
+		key = g_ptr_array_index(keys, i);
+		entry = g_hash_table_lookup(entries, key);
+		success = fwrite(key, strlen(key) + 1, 1, file) == 1 &&
+				fwrite(entry->translation, strlen(entry->translation) + 1, 1, file) == 1;
+	}
+
+	if (fclose(file) != 0)
+		success = FALSE;
+
+	if (!success || g_rename(temp_filename, filename) != 0)
+	{
+		fprintf(stderr, "Could not write %s\n", filename);
+		g_unlink(temp_filename);
+		success = FALSE;
+	} else {
+		printf("%s: %u entries, %u bytes\n", filename, keys->len, offset);
+	}
+
+	g_ptr_array_free(keys, TRUE);
+	g_free(temp_filename);
+
+	return success;
+}
+
+static gboolean
+phrasetable_check(const gchar *table_filename, const gchar *filename)
+{
+	GMappedFile *table;
+	const gchar *data, *translation;
+	gchar *contents, **lines, **fields;
+	gchar *key, *normal;
+	GError *error = NULL;
+	gsize length;
+	guint32 count;
+	guint i, checked = 0, failed = 0;
+
+	table = g_mapped_file_new(table_filename, FALSE, &error);
+	if (table == NULL)
+	{
+		fprintf(stderr, "Could not read %s: %s\n", table_filename, error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+	data = g_mapped_file_get_contents(table);
+	length = g_mapped_file_get_length(table);
+	count = translate_phrases_count_records(data, length);
+	if (count == 0)
+	{
+		fprintf(stderr, "%s is not a phrase table\n", table_filename);
+		g_mapped_file_unref(table);
+		return FALSE;
+	}
+
+	if (!g_file_get_contents(filename, &contents, NULL, &error))
+	{
+		fprintf(stderr, "Could not read %s: %s\n", filename, error->message);
+		g_error_free(error);
+		g_mapped_file_unref(table);
+		return FALSE;
+	}
+	lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+
+	for(i = 0; lines[i]; i++)
+	{
+		g_strchomp(lines[i]);
+		if (lines[i][0] == '\0' || lines[i][0] == '#')
+			continue;
+
+		fields = g_strsplit(lines[i], "\t", 4);
+		if (g_strv_length(fields) != 4)
+		{
+			fprintf(stderr, "%s:%u: expected from, to, phrase and expected translation separated by tabs\n", filename, i + 1);
+			g_strfreev(fields);
+			failed++;
+			continue;
+		}
+
+		key = translate_phrases_make_key(fields[0], fields[1], fields[2]);
+		translation = translate_phrases_search(data, length, count, key);
+		g_free(key);
+		if (translation == NULL)
+		{
+			normal = translate_phrases_normalize(fields[2]);
+			key = translate_phrases_make_key(fields[0], fields[1], normal);
+			translation = translate_phrases_search(data, length, count, key);
+			g_free(key);
+			g_free(normal);
+		}
+
+		if (g_str_equal(fields[3], "-") ? translation != NULL : (translation == NULL || !g_str_equal(translation, fields[3])))
+		{
+			fprintf(stderr, "%s:%u: \"%s\" gave %s, expected %s\n", filename, i + 1, fields[2],
+					translation ? translation : "-", fields[3]);
+			failed++;
+		}
+		checked++;
+		g_strfreev(fields);
+	}
+
+	g_strfreev(lines);
+	g_mapped_file_unref(table);
+
+	printf("%s: %u lookups, %u failed\n", filename, checked, failed);
+
+	return failed == 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	GHashTable *entries;
+	gboolean success = TRUE;
+	int i;
+
+	if (argc == 4 && g_str_equal(argv[1], "--check"))
+		return phrasetable_check(argv[2], argv[3]) ? 0 : 1;
+
+	if (argc < 3)
+	{
+		fprintf(stderr, "Usage: %s OUTPUT.db PHRASES.tsv...\n"
+				"       %s --check TABLE.db LOOKUPS.tsv\n", argv[0], argv[0]);
+		return 2;
+	}
+
+	entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, phrasetable_entry_free);
+
+	for(i = 2; i < argc; i++)
+		success = phrasetable_read(entries, argv[i]) && success;
+
+	if (success)
+		success = phrasetable_write(entries, argv[1]);
+
+	g_hash_table_destroy(entries);
+
+	return success ? 0 : 1;
+}
@@ -0,0 +1,195 @@
+/*
+ * libpurple-translate
+ * Copyright (C) 2010  Eion Robb
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+/*
+ * Checks the plugin's sentence splitter against a list of messages and the
+ * sentences they should be split into:
+ *
+ *     purple-translate-sentences-check CASES.txt
+ *
+ * One case a line, with \n and the like in the message written as escapes:
+ *
+ *     message<TAB>its sentences, separated by " | "
+ *
+ * Also checks that a long run with no sentence ends is cut between words.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "purple-translate-sentences.h"
+
+/** The sentences text is split into, separated by " | ", or NULL if the spans
+  * don't cover it exactly */
+static gchar *
+check_split(const gchar *text, GArray **spans_out)
+{
+	GArray *spans;
+	GString *sentences;
+	TranslateSpan whole, *span;
+	gsize covered = 0;
+	guint i;
+
+	whole.start = 0;
+	whole.len = strlen(text);
+	whole.translate = TRUE;
+
+	spans = g_array_new(FALSE, FALSE, sizeof(TranslateSpan));
+	translate_spans_add_sentences(spans, text, &whole);
+
+	sentences = g_string_new(NULL);
+	for(i = 0; i < spans->len; i++)
+	{
+		span = &g_array_index(spans, TranslateSpan, i);
+		if (span->start != covered)
+			break;
+		covered += span->len;
+		if (!span->translate)
+			continue;
+		if (sentences->len)
+			g_string_append(sentences, " | ");
+		g_string_append_len(sentences, text + span->start, span->len);
+	}
+
+	if (spans_out != NULL)
+		*spans_out = spans;
+	else
+		g_array_free(spans, TRUE);
+
+	if (covered != whole.len)
+	{
+		g_string_free(sentences, TRUE);
+		return NULL;
+	}
+	return g_string_free(sentences, FALSE);
+}
+
+static gboolean
+check_cases(const gchar *filename)
+{
+	gchar *contents, **lines, **fields;
+	gchar *text, *expected, *sentences;
+	GError *error = NULL;
+	guint i, checked = 0, failed = 0;
+
+	if (!g_file_get_contents(filename, &contents, NULL, &error))
+	{
+		fprintf(stderr, "Could not read %s: %s\n", filename, error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+	lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+
+	for(i = 0; lines[i]; i++)
+	{
+		if (lines[i][0] == '\0' || lines[i][0] == '#')
+			continue;
+
+		fields = g_strsplit(lines[i], "\t", 2);
+		if (g_strv_length(fields) != 2)
+		{
+			fprintf(stderr, "%s:%u: expected a message and its sentences separated by a tab\n", filename, i + 1);
+			g_strfreev(fields);
+			failed++;
+			continue;
+		}
+
+		text = g_strcompress(fields[0]);
+		expected = g_strcompress(fields[1]);
+		sentences = check_split(text, NULL);
+		if (sentences == NULL || !g_str_equal(sentences, expected))
+		{
+			fprintf(stderr, "%s:%u: \"%s\" split into \"%s\", expected \"%s\"\n", filename, i + 1, fields[0],
+					sentences ? sentences : "(spans with gaps)", expected);
+			failed++;
+		}
+		checked++;
+
+		g_free(sentences);
+		g_free(expected);
+		g_free(text);
+		g_strfreev(fields);
+	}
+	g_strfreev(lines);
+
+	printf("%s: %u cases, %u failed\n", filename, checked, failed);
+
+	return failed == 0;
+}
+
+/** A run too long to go as one sentence has to come out in pieces that fit, cut
+  * between words */
+static gboolean
+check_long_run(void)
+{
+	GString *text;
+	GArray *spans;
+	TranslateSpan *span;
+	gchar *sentences;
+	gboolean success = TRUE;
+	guint i;
+
+	text = g_string_new(NULL);
+	for(i = 0; i < 300; i++)
+		g_string_append(text, (i % 3) ? "word " : "another ");
+	g_string_append(text, "end");
+
+	sentences = check_split(text->str, &spans);
+	if (sentences == NULL)
+		success = FALSE;
+	for(i = 0; success && i < spans->len; i++)
+	{
+		span = &g_array_index(spans, TranslateSpan, i);
+		if (!span->translate)
+			continue;
+		if (span->len > TRANSLATE_SEGMENT_MAX || g_ascii_isspace(text->str[span->start]) ||
+			g_ascii_isspace(text->str[span->start + span->len - 1]) ||
+			(span->start + span->len < text->len && !g_ascii_isspace(text->str[span->start + span->len])))
+			success = FALSE;
+	}
+
+	printf("Long run: %u bytes in %u spans, %s\n", (guint) text->len, spans->len, success ? "ok" : "FAILED");
+
+	g_free(sentences);
+	g_array_free(spans, TRUE);
+	g_string_free(text, TRUE);
+
+	return success;
+}
+
+int
+main(int argc, char **argv)
+{
+	gboolean success;
+
+	if (argc != 2)
+	{
+		fprintf(stderr, "Usage: %s CASES.txt\n", argv[0]);
+		return 2;
+	}
+
+	success = check_cases(argv[1]);
+	success = check_long_run() && success;
+
+	return success ? 0 : 1;
+}
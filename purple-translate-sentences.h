@@ -0,0 +1,149 @@
+/*
+ * libpurple-translate
+ * Copyright (C) 2010  Eion Robb
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef PURPLE_TRANSLATE_SENTENCES_H
+#define PURPLE_TRANSLATE_SENTENCES_H
+
+#include <glib.h>
+#include <string.h>
+
+/** The sentence splitter messages go through before they're translated, shared by
+  * the plugin and purple-translate-sentences-check */
+
+/** A run of a message that either goes to the translator or is kept as it is */
+typedef struct {
+	gsize start;
+	gsize len;
+	gboolean translate;
+} TranslateSpan;
+
+/** Longest piece of a sentence sent on its own, in bytes, so that even a huge paste
+  * fits in a request once it's been url encoded */
+#define TRANSLATE_SEGMENT_MAX 400
+
+/** Abbreviations (without their last full stop) that are followed by more of the
+  * same sentence, however the next word is capitalised */
+static const gchar *translate_abbreviations[] = {
+	"mr", "mrs", "ms", "dr", "prof", "sr", "jr", "st", "mt", "ft", "vs", "etc",
+	"e.g", "i.e", "cf", "approx", "vol", "fig", "inc", "ltd", "co", "corp",
+	"jan", "feb", "mar", "apr", "jun", "jul", "aug", "sep", "sept", "oct", "nov", "dec",
+	NULL
+};
+
+/** Whether the word that ends with the full stop at pos is an abbreviation or an
+  * initial, rather than the end of a sentence */
+static gboolean
+translate_is_abbreviation(const gchar *start, const gchar *pos)
+{
+	const gchar *word = pos;
+	gsize len;
+	guint i;
+	
+	while (word > start && !g_ascii_isspace(word[-1]) && word[-1] != '(' && word[-1] != '"')
+		word--;
+	len = pos - word;
+	
+	// "J. Smith"
+	if (len == 1 && g_ascii_isupper(*word))
+		return TRUE;
+	
+	for(i = 0; translate_abbreviations[i]; i++)
+		if (strlen(translate_abbreviations[i]) == len && g_ascii_strncasecmp(word, translate_abbreviations[i], len) == 0)
+			return TRUE;
+	
+	return FALSE;
+}
+
+/** Whether the character at pos ends a sentence, given what comes after it; start
+  * is the beginning of the run it's in */
+static gboolean
+translate_is_sentence_end(const gchar *start, const gchar *pos, const gchar *end)
+{
+	gunichar c = g_utf8_get_char(pos);
+	const gchar *next = g_utf8_next_char(pos);
+	
+	// These don't need a space after them
+	if (c == '\n' || c == 0x3002 || c == 0xFF01 || c == 0xFF1F)
+		return TRUE;
+	if (c != '.' && c != '!' && c != '?')
+		return FALSE;
+	if (next >= end || !g_ascii_isspace(*next))
+		return FALSE;
+	
+	// "Mr. Smith" and "e.g. Paris" carry on the same sentence
+	if (c == '.' && translate_is_abbreviation(start, pos))
+		return FALSE;
+	
+	// "etc. and so on" carries on the same sentence
+	while (next < end && g_ascii_isspace(*next))
+		next++;
+	return c != '.' || next >= end || !g_ascii_islower(*next);
+}
+
+/** Adds a run to be translated as one or more sentences, each its own span with the
+  * whitespace between them kept out, so that each is cached on its own */
+static void
+translate_spans_add_sentences(GArray *spans, const gchar *text, const TranslateSpan *span)
+{
+	const gchar *pos = text + span->start;
+	const gchar *end = pos + span->len;
+	const gchar *cut, *space, *p;
+	TranslateSpan sentence;
+	
+	while (pos < end)
+	{
+		cut = end;
+		space = NULL;
+		for(p = pos; p < end; p = g_utf8_next_char(p))
+		{
+			if (p - pos >= TRANSLATE_SEGMENT_MAX)
+			{
+				// Too long to go as one, so break it between words if we can
+				cut = (space != NULL) ? space : p;
+				break;
+			}
+			if (g_ascii_isspace(*p))
+				space = p;
+			if (translate_is_sentence_end(pos, p, end))
+			{
+				// Line breaks are kept out with the rest of the whitespace
+				cut = (*p == '\n') ? p : g_utf8_next_char(p);
+				break;
+			}
+		}
+		
+		sentence.start = pos - text;
+		sentence.len = cut - pos;
+		sentence.translate = TRUE;
+		if (sentence.len)
+			g_array_append_val(spans, sentence);
+		
+		for(pos = cut; pos < end && g_ascii_isspace(*pos); pos++);
+		if (pos > cut)
+		{
+			sentence.start = cut - text;
+			sentence.len = pos - cut;
+			sentence.translate = FALSE;
+			g_array_append_val(spans, sentence);
+		}
+	}
+}
+
+#endif /* PURPLE_TRANSLATE_SENTENCES_H */
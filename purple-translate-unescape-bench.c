@@ -0,0 +1,167 @@
+/*
+ * libpurple-translate
+ * Copyright (C) 2010  Eion Robb
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/*
+ * Times the plugin's escape decoder against the convert_unicode() it replaced,
+ * on long translations that are almost all \uXXXX escapes (Chinese, Russian,
+ * Arabic), as the services send them back:
+ *
+ *     purple-translate-unescape-bench [CHARACTERS [ROUNDS]]
+ *
+ * Exits non-zero if the two decoders don't agree.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "purple-translate-unescape.h"
+
+/** convert_unicode() as it was, moving the rest of the string along for every escape.
+  * It did that with g_stpcpy(), which isn't meant for overlapping strings and
+  * garbles them with some C libraries, so here it's the memmove() it meant */
+static gchar *
+bench_old_convert_unicode(const gchar *input)
+{
+	gunichar unicode_char;
+	gchar unicode_char_str[6];
+	gint unicode_char_len;
+	gchar *next_pos;
+	gchar *input_string;
+	gchar *output_string;
+
+	next_pos = input_string = g_strdup(input);
+
+	while ((next_pos = strstr(next_pos, "\\u")))
+	{
+		sscanf(next_pos, "\\u%4x", &unicode_char);
+		unicode_char_len = g_unichar_to_utf8(unicode_char, unicode_char_str);
+		memmove(next_pos, unicode_char_str, unicode_char_len);
+		memmove(next_pos + unicode_char_len, next_pos + 6, strlen(next_pos + 6) + 1);
+	}
+
+	output_string = g_strcompress(input_string);
+	g_free(input_string);
+
+	return output_string;
+}
+
+static gchar *
+bench_new_convert_unicode(const gchar *input)
+{
+	GString *output;
+	gsize len = strlen(input);
+
+	output = g_string_sized_new(len);
+	translate_unescape(output, input, input + len, FALSE);
+
+	return g_string_free(output, FALSE);
+}
+
+/** Escaped text of about characters characters from the range first..first+span,
+  * broken into sentences the way a translation would be */
+static gchar *
+bench_make_input(gunichar first, guint span, guint characters)
+{
+	GString *input;
+	guint i;
+
+	input = g_string_sized_new(characters * 6 + 16);
+	for(i = 0; i < characters; i++)
+	{
+		if (i % 40 == 39)
+			g_string_append(input, "\\n");
+		else if (i % 8 == 7 && first < 0x3000)
+			g_string_append_c(input, ' ');
+		else
+			g_string_append_printf(input, "\\u%04x", first + g_random_int_range(0, span));
+	}
+
+	return g_string_free(input, FALSE);
+}
+
+static gboolean
+bench_run(const gchar *name, const gchar *input, guint rounds)
+{
+	GTimer *timer;
+	gchar *old_output = NULL, *new_output = NULL;
+	gdouble old_time, new_time;
+	gboolean same;
+	guint i;
+
+	timer = g_timer_new();
+	for(i = 0; i < rounds; i++)
+	{
+		g_free(old_output);
+		old_output = bench_old_convert_unicode(input);
+	}
+	old_time = g_timer_elapsed(timer, NULL);
+
+	g_timer_start(timer);
+	for(i = 0; i < rounds; i++)
+	{
+		g_free(new_output);
+		new_output = bench_new_convert_unicode(input);
+	}
+	new_time = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	same = g_str_equal(old_output, new_output);
+	printf("%-10s %8u bytes  old %9.3f ms  new %7.3f ms  %6.1fx%s\n", name, (guint) strlen(input),
+		old_time * 1000 / rounds, new_time * 1000 / rounds, new_time > 0 ? old_time / new_time : 0.0,
+		same ? "" : "  OUTPUT DIFFERS");
+
+	g_free(old_output);
+	g_free(new_output);
+
+	return same;
+}
+
+int
+main(int argc, char **argv)
+{
+	guint characters = (argc > 1) ? atoi(argv[1]) : 10000;
+	guint rounds = (argc > 2) ? atoi(argv[2]) : 5;
+	gchar *input;
+	gboolean success = TRUE;
+
+	if (characters == 0 || rounds == 0)
+	{
+		fprintf(stderr, "Usage: %s [CHARACTERS [ROUNDS]]\n", argv[0]);
+		return 2;
+	}
+
+	g_random_set_seed(1);
+
+	input = bench_make_input(0x4E00, 0x5000, characters);
+	success = bench_run("Chinese", input, rounds) && success;
+	g_free(input);
+
+	input = bench_make_input(0x0410, 0x40, characters);
+	success = bench_run("Russian", input, rounds) && success;
+	g_free(input);
+
+	input = bench_make_input(0x0621, 0x1A, characters);
+	success = bench_run("Arabic", input, rounds) && success;
+	g_free(input);
+
+	return success ? 0 : 1;
+}
@@ -0,0 +1,119 @@
+/*
+ * libpurple-translate
+ * Copyright (C) 2010  Eion Robb
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef PURPLE_TRANSLATE_UNESCAPE_H
+#define PURPLE_TRANSLATE_UNESCAPE_H
+
+#include <glib.h>
+#include <string.h>
+
+/** The escape decoder the services' responses go through, shared by the plugin
+  * and purple-translate-unescape-bench */
+
+/** Reads the four hex digits of a \uXXXX escape, or returns -1 */
+static gint
+translate_unescape_hex4(const gchar *pos)
+{
+	gint value = 0, digit, i;
+	
+	for(i = 0; i < 4; i++)
+	{
+		if ((digit = g_ascii_xdigit_value(pos[i])) < 0)
+			return -1;
+		value = (value << 4) | digit;
+	}
+	
+	return value;
+}
+
+/** Decodes backslash escapes (\uXXXX including surrogate pairs, and the usual
+  * \n, \t, \" and friends) from pos onto the end of output in a single pass.
+  * Runs without escapes are found with memchr and copied in one go.  If
+  * until_quote is set, stops at the first unescaped quote and returns the
+  * position after it (or NULL if there isn't one), otherwise decodes up to end */
+static const gchar *
+translate_unescape(GString *output, const gchar *pos, const gchar *end, gboolean until_quote)
+{
+	const gchar *quote = NULL;
+	const gchar *backslash;
+	const gchar *run_end;
+	gint unicode_char, low;
+	
+	for(;;)
+	{
+		if (until_quote && (quote == NULL || quote < pos))
+		{
+			quote = memchr(pos, '"', end - pos);
+			if (quote == NULL)
+				return NULL;
+		}
+		run_end = until_quote ? quote : end;
+		
+		backslash = memchr(pos, '\\', run_end - pos);
+		if (backslash == NULL)
+		{
+			g_string_append_len(output, pos, run_end - pos);
+			return until_quote ? run_end + 1 : end;
+		}
+		
+		g_string_append_len(output, pos, backslash - pos);
+		pos = backslash + 1;
+		if (pos >= end)
+			return NULL;
+		
+		switch(*pos)
+		{
+			case 'b': g_string_append_c(output, '\b'); break;
+			case 'f': g_string_append_c(output, '\f'); break;
+			case 'n': g_string_append_c(output, '\n'); break;
+			case 'r': g_string_append_c(output, '\r'); break;
+			case 't': g_string_append_c(output, '\t'); break;
+			case 'u':
+				if (end - pos < 5 || (unicode_char = translate_unescape_hex4(pos + 1)) < 0)
+					return NULL;
+				pos += 4;
+				
+				if (unicode_char >= 0xD800 && unicode_char <= 0xDBFF)
+				{
+					// High surrogate, which needs the low half that follows to mean anything
+					if (end - pos >= 7 && pos[1] == '\\' && pos[2] == 'u' &&
+						(low = translate_unescape_hex4(pos + 3)) >= 0xDC00 && low <= 0xDFFF)
+					{
+						unicode_char = 0x10000 + ((unicode_char - 0xD800) << 10) + (low - 0xDC00);
+						pos += 6;
+					} else {
+						unicode_char = 0xFFFD;
+					}
+				} else if (unicode_char >= 0xDC00 && unicode_char <= 0xDFFF) {
+					unicode_char = 0xFFFD;
+				}
+				
+				g_string_append_unichar(output, unicode_char);
+				break;
+			default:
+				g_string_append_c(output, *pos);
+				break;
+		}
+		
+		pos++;
+	}
+}
+
+#endif /* PURPLE_TRANSLATE_UNESCAPE_H */
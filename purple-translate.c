@@ -24,265 +24,5184 @@
 #define BING_APPID "0FFF5300CD157A2E748DFCCF6D67F8028E5B578D"
 
 #include <glib.h>
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#	include "win32dep.h"
+#	include <io.h>
+#else
+#	include <unistd.h>
+#endif
+
 #include "util.h"
 #include "plugin.h"
 #include "debug.h"
+#include "notify.h"
+#include "prefs.h"
+#include "eventloop.h"
+#include "proxy.h"
+#include "signals.h"
+#include "value.h"
+
+#include "purple-translate-phrases.h"
+#include "purple-translate-sentences.h"
+#include "purple-translate-unescape.h"
+
+#include <zlib.h>
+
+/** translated_phrase is the original phrase, and error_message is set, if it couldn't be translated.
+  * detected_language is interned (see translate_language_canonical()) so it can be kept as it is */
+typedef void(* TranslateCallback)(const gchar *original_phrase, const gchar *translated_phrase, const gchar *detected_language, const gchar *error_message, gpointer userdata);
+
+/** How urgently a phrase is wanted, most urgent first */
+typedef enum {
+	TRANSLATE_PRIORITY_OUTGOING = 0, //our own messages, which are held until translated
+	TRANSLATE_PRIORITY_IM,
+	TRANSLATE_PRIORITY_CHAT,
+	TRANSLATE_PRIORITY_SPECULATIVE, //drafts translated ahead of being sent, only when nothing else is waiting
+	TRANSLATE_PRIORITY_COUNT
+} TranslatePriority;
+
+/** Strings owned by a pooled object, packed into one buffer that's kept when the
+  * object is recycled.  A string that doesn't fit in what's left gets an allocation
+  * of its own, freed when the arena is reset */
+typedef struct {
+	gchar *data;
+	gsize size;
+	gsize used;
+	GSList *overflow;
+} TranslateArena;
+
+/** Largest arena kept when its object is recycled, so that one huge paste doesn't
+  * hold on to its memory for the rest of the session */
+#define TRANSLATE_ARENA_KEEP 4096
+
+/** Most objects of each kind kept for reuse */
+#define TRANSLATE_POOL_MAX 64
+
+/** Makes sure an empty arena has room for size bytes in one piece */
+static void
+translate_arena_reserve(TranslateArena *arena, gsize size)
+{
+	if (arena->used == 0 && size > arena->size)
+	{
+		g_free(arena->data);
+		arena->data = g_malloc(size);
+		arena->size = size;
+	}
+}
+
+static gchar *
+translate_arena_alloc(TranslateArena *arena, gsize size)
+{
+	gchar *block;
+	
+	if (arena->used + size > arena->size)
+	{
+		block = g_malloc(size);
+		arena->overflow = g_slist_prepend(arena->overflow, block);
+		return block;
+	}
+	
+	block = arena->data + arena->used;
+	arena->used += size;
+	return block;
+}
+
+static gchar *
+translate_arena_strdup(TranslateArena *arena, const gchar *str)
+{
+	gchar *copy;
+	gsize len;
+	
+	if (str == NULL)
+		return NULL;
+	
+	len = strlen(str) + 1;
+	copy = translate_arena_alloc(arena, len);
+	memcpy(copy, str, len);
+	return copy;
+}
+
+/** Forgets every string in the arena, ready for its object to be used again */
+static void
+translate_arena_reset(TranslateArena *arena)
+{
+	GSList *l;
+	
+	for(l = arena->overflow; l; l = l->next)
+		g_free(l->data);
+	g_slist_free(arena->overflow);
+	arena->overflow = NULL;
+	arena->used = 0;
+	
+	if (arena->size > TRANSLATE_ARENA_KEEP)
+	{
+		g_free(arena->data);
+		arena->data = NULL;
+		arena->size = 0;
+	}
+}
+
+static void
+translate_arena_free(TranslateArena *arena)
+{
+	translate_arena_reset(arena);
+	g_free(arena->data);
+	arena->data = NULL;
+	arena->size = 0;
+}
 
-/** This is the list of languages we support, populated in plugin_init */
-static GList *supported_languages = NULL;
+static guint translate_pool_reused = 0;
 
-typedef void(* TranslateCallback)(const gchar *original_phrase, const gchar *translated_phrase, const gchar *detected_language, gpointer userdata);
+/** A phrase to translate.  Its strings all live in its arena, and it goes back on
+  * translate_store_pool rather than being freed */
 struct _TranslateStore {
 	gchar *original_phrase;
 	TranslateCallback callback;
 	gpointer userdata;
-	gchar *detected_language; //optional - needed for Bing
+	const gchar *detected_language; //optional - needed for Bing; interned
+	gchar *cache_key; //where to store the result in the cache
+	gboolean no_store; //the result shouldn't be cached
+	gchar *translated_phrase; //only set when answered locally
+	const gchar *error_message; //only set when failed locally
+	GSList *waiters; //other stores for the same phrase, answered by this one's request
+	TranslatePriority priority;
+	gconstpointer owner; //usually the conversation, so the scheduler can take turns between them
+	struct _TranslateBatch *batch; //the batch fetching it, while there is one
+	TranslateArena arena;
+	struct _TranslateStore *next_free; //while it's in translate_store_pool
+};
+
+/** The plugin's prefs, read once in plugin_load and reloaded whenever one of them
+  * changes, so the message path never has to look a pref up by its path */
+typedef struct {
+	struct _TranslateBackend *backend; //the service pref, resolved; NULL if it's not registered
+	struct _TranslateBackend *fallback; //the fallback_service pref, for phrases the phrase table doesn't have
+	const struct _TranslateLanguage *locale; //the locale pref, resolved
+	gsize cache_size; //bytes
+	gsize store_size; //bytes
+	gint batch_window; //ms
+	guint batch_size;
+	gint detect_confidence; //percent, over 100 turns local detection off
+	guint http_max_connections; //per host
+	guint http_idle_timeout; //seconds
+	guint max_in_flight; //batches sent and not yet answered, across all services
+	guint request_timeout; //ms before a request is given up on
+	guint hedge_delay; //ms before a slow request is also sent to another service, 0 to never
+	guint reorder_timeout; //ms a message may hold up the ones after it
+	gboolean speculate; //translate drafts while they're being typed
+	guint speculate_delay; //ms a draft has to stay the same before it's translated
+	guint speculate_budget; //characters of drafts that may be sent a minute
+	gint mock_latency; //ms
+	gint mock_error_rate; //percent
+} TranslateConfig;
+
+static TranslateConfig translate_config;
+
+/** Bumped whenever the prefs or the buddy list change, so that every conversation
+  * works out its translation state again the next time it's used */
+static guint translate_conv_generation = 1;
+
+/** A single translated phrase in the cache, most recently used at the head of translate_cache_lru */
+struct _TranslateCacheEntry {
+	gchar *key;
+	gchar *translated_phrase;
+	const gchar *detected_language; //interned
+	gsize size;
+	GList *link;
 };
 
-/** Converts unicode strings such as \003d into =
-  * Code blatantly nicked from the Facebook plugin */
+static GHashTable *translate_cache = NULL;
+static GQueue translate_cache_lru = G_QUEUE_INIT;
+static gsize translate_cache_size = 0;
+static guint translate_cache_hits = 0;
+static guint translate_cache_misses = 0;
+static guint translate_cache_evictions = 0;
+
+/** Stores with a request on the wire, keyed by their cache key, so that asking for
+  * the same phrase again while it's being fetched doesn't make another request */
+static GHashTable *translate_inflight = NULL;
+static guint translate_inflight_joined = 0;
+
+/** The on-disk translation memory is an append-only log of records that
+  * survives restarts.  Each record is [key length][value length][checksum][key][value]
+  * with the value being "translated\0detected language".  The log is memory-mapped
+  * for reading, and an index of key hash -> record offset is rebuilt when it is opened.
+  * The rare key whose hash is already taken by a different key is indexed by the
+  * whole key in translate_db_collisions instead */
+#define TRANSLATE_DB_MAGIC "PTDB0001"
+#define TRANSLATE_DB_HEADER_LEN 8
+#define TRANSLATE_DB_RECORD_HEADER_LEN 12
+
+static gchar *translate_db_filename = NULL;
+static gboolean translate_db_opened = FALSE;
+static GMappedFile *translate_db_map = NULL;
+static FILE *translate_db_file = NULL;
+static GHashTable *translate_db_index = NULL;
+static GHashTable *translate_db_collisions = NULL;
+static gsize translate_db_length = 0;
+static gsize translate_db_dead = 0;
+static guint translate_db_hits = 0;
+
+/** Converts unicode strings such as \003d into = */
 gchar *
 convert_unicode(const gchar *input)
 {
-	gunichar unicode_char;
-	gchar unicode_char_str[6];
-	gint unicode_char_len;
-	gchar *next_pos;
-	gchar *input_string;
-	gchar *output_string;
+	GString *output;
+	gsize len;
 
 	if (input == NULL)
 		return NULL;
+	
+	len = strlen(input);
+	output = g_string_sized_new(len);
+	translate_unescape(output, input, input + len, FALSE);
+	
+	return g_string_free(output, FALSE);
+}
+
+/** Builds the lookup key for a phrase in arena, collapsing runs of whitespace so
+  * that "ok " and " ok" share a cache entry */
+static gchar *
+translate_cache_make_key(TranslateArena *arena, const gchar *service, const gchar *from_lang, const gchar *to_lang, const gchar *phrase)
+{
+	gchar *key, *pos;
+	gsize service_len, from_len, to_len;
+	gboolean in_space = FALSE;
+	
+	if (!from_lang || !(*from_lang))
+		from_lang = "auto";
+	
+	service_len = strlen(service);
+	from_len = strlen(from_lang);
+	to_len = strlen(to_lang);
+	
+	// Collapsing whitespace only ever makes the phrase shorter
+	key = translate_arena_alloc(arena, service_len + from_len + to_len + 3 + strlen(phrase) + 1);
+	pos = key;
+	memcpy(pos, service, service_len);
+	pos += service_len;
+	*pos++ = '|';
+	memcpy(pos, from_lang, from_len);
+	pos += from_len;
+	*pos++ = '|';
+	memcpy(pos, to_lang, to_len);
+	pos += to_len;
+	*pos++ = '|';
+	
+	while (g_ascii_isspace(*phrase))
+		phrase++;
+	for(; *phrase; phrase++)
+	{
+		if (g_ascii_isspace(*phrase))
+		{
+			in_space = TRUE;
+			continue;
+		}
+		if (in_space)
+			*pos++ = ' ';
+		in_space = FALSE;
+		*pos++ = *phrase;
+	}
+	*pos = '\0';
+	
+	return key;
+}
+
+static void
+translate_cache_entry_free(struct _TranslateCacheEntry *entry)
+{
+	g_free(entry->key);
+	g_free(entry->translated_phrase);
+	g_free(entry);
+}
+
+static void
+translate_cache_remove(struct _TranslateCacheEntry *entry)
+{
+	g_queue_delete_link(&translate_cache_lru, entry->link);
+	translate_cache_size -= entry->size;
+	g_hash_table_remove(translate_cache, entry->key);
+}
+
+/** Drops the least recently used entries until the cache fits in the configured size */
+static void
+translate_cache_trim(void)
+{
+	gsize max_size;
+	struct _TranslateCacheEntry *entry;
+	
+	if (translate_cache == NULL)
+		return;
+	
+	max_size = translate_config.cache_size;
+	
+	while (translate_cache_size > max_size && (entry = g_queue_peek_tail(&translate_cache_lru)))
+	{
+		translate_cache_remove(entry);
+		translate_cache_evictions++;
+	}
+}
+
+static void
+translate_cache_insert(const gchar *key, const gchar *translated_phrase, const gchar *detected_language)
+{
+	struct _TranslateCacheEntry *entry;
+	
+	if (translate_cache == NULL)
+		translate_cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)translate_cache_entry_free);
+	
+	entry = g_hash_table_lookup(translate_cache, key);
+	if (entry != NULL)
+		translate_cache_remove(entry);
+	
+	entry = g_new0(struct _TranslateCacheEntry, 1);
+	entry->key = g_strdup(key);
+	entry->translated_phrase = g_strdup(translated_phrase);
+	entry->detected_language = detected_language; //already interned by translate_language_canonical()
+	entry->size = sizeof(struct _TranslateCacheEntry) + strlen(key) + strlen(translated_phrase) + 2;
+	
+	g_queue_push_head(&translate_cache_lru, entry);
+	entry->link = g_queue_peek_head_link(&translate_cache_lru);
+	g_hash_table_insert(translate_cache, entry->key, entry);
+	translate_cache_size += entry->size;
+	
+	translate_cache_trim();
+}
+
+static void
+translate_cache_clear(void)
+{
+	if (translate_cache != NULL)
+		g_hash_table_destroy(translate_cache);
+	translate_cache = NULL;
+	g_queue_clear(&translate_cache_lru);
+	translate_cache_size = 0;
+}
+
+/** FNV-1a, used both to index the translation memory and to checksum its records */
+static guint32
+translate_hash_bytes(guint32 hash, const gchar *data, gsize len)
+{
+	gsize i;
+	
+	for(i = 0; i < len; i++)
+	{
+		hash ^= (guchar) data[i];
+		hash *= 16777619;
+	}
+	
+	return hash;
+}
+#define TRANSLATE_HASH_INIT 2166136261U
+
+/** A language we can translate to or from, by the code we store in prefs */
+typedef struct _TranslateLanguage {
+	const gchar *code;
+	const gchar *name;
+} TranslateLanguage;
+
+/** Another code that means the same language as one of ours */
+typedef struct {
+	const gchar *alias;
+	const gchar *code;
+} TranslateLanguageAlias;
+
+/** The languages we support, in the order they're shown in menus */
+static const TranslateLanguage translate_languages[] = {
+	{"af", "Afrikaans"},
+	{"sq", "Albanian"},
+	{"ar", "Arabic"},
+	{"hy", "Armenian"},
+	{"az", "Azerbaijani"},
+	{"eu", "Basque"},
+	{"be", "Belarusian"},
+	{"bg", "Bulgarian"},
+	{"ca", "Catalan"},
+	{"zh-CN", "Chinese (Simplified)"},
+	{"zh-TW", "Chinese (Traditional)"},
+	{"hr", "Croatian"},
+	{"cs", "Czech"},
+	{"da", "Danish"},
+	{"nl", "Dutch"},
+	{"en", "English"},
+	{"et", "Estonian"},
+	{"tl", "Filipino"},
+	{"fi", "Finnish"},
+	{"fr", "French"},
+	{"gl", "Galician"},
+	{"ka", "Georgian"},
+	{"de", "German"},
+	{"el", "Greek"},
+	{"ht", "Haitian Creole"},
+	{"iw", "Hebrew"},
+	{"hi", "Hindi"},
+	{"hu", "Hungarian"},
+	{"is", "Icelandic"},
+	{"id", "Indonesian"},
+	{"ga", "Irish"},
+	{"it", "Italian"},
+	{"ja", "Japanese"},
+	{"ko", "Korean"},
+	{"la", "Latin"},
+	{"lv", "Latvian"},
+	{"lt", "Lithuanian"},
+	{"mk", "Macedonian"},
+	{"ms", "Malay"},
+	{"mt", "Maltese"},
+	{"no", "Norwegian"},
+	{"fa", "Persian"},
+	{"pl", "Polish"},
+	{"pt", "Portuguese"},
+	{"ro", "Romanian"},
+	{"ru", "Russian"},
+	{"sr", "Serbian"},
+	{"sk", "Slovak"},
+	{"sl", "Slovenian"},
+	{"es", "Spanish"},
+	{"sw", "Swahili"},
+	{"sv", "Swedish"},
+	{"th", "Thai"},
+	{"tr", "Turkish"},
+	{"uk", "Ukrainian"},
+	{"ur", "Urdu"},
+	{"vi", "Vietnamese"},
+	{"cy", "Welsh"},
+	{"yi", "Yiddish"},
+};
+
+/** Codes other services and locales use for the languages above */
+static const TranslateLanguageAlias translate_language_aliases[] = {
+	{"he", "iw"},
+	{"zh", "zh-CN"},
+	{"zh-CHS", "zh-CN"},
+	{"zh-Hans", "zh-CN"},
+	{"zh-CHT", "zh-TW"},
+	{"zh-Hant", "zh-TW"},
+	{"nb", "no"},
+	{"fil", "tl"},
+};
+
+/** Open-addressed lookup tables over the static arrays above, filled in once
+  * by translate_languages_init() without allocating anything */
+typedef struct {
+	const gchar *key;
+	const TranslateLanguage *language;
+} TranslateLanguageSlot;
+
+#define TRANSLATE_LANGUAGE_SLOTS 256
+static TranslateLanguageSlot translate_language_codes[TRANSLATE_LANGUAGE_SLOTS];
+static TranslateLanguageSlot translate_language_names[TRANSLATE_LANGUAGE_SLOTS];
+static gboolean translate_languages_indexed = FALSE;
+
+static void
+translate_language_index_add(TranslateLanguageSlot *index, const gchar *key, const TranslateLanguage *language)
+{
+	guint slot = translate_hash_bytes(TRANSLATE_HASH_INIT, key, strlen(key)) & (TRANSLATE_LANGUAGE_SLOTS - 1);
+	
+	while (index[slot].key != NULL)
+		slot = (slot + 1) & (TRANSLATE_LANGUAGE_SLOTS - 1);
+	
+	index[slot].key = key;
+	index[slot].language = language;
+}
+
+static const TranslateLanguage *
+translate_language_index_find(const TranslateLanguageSlot *index, const gchar *key)
+{
+	guint slot;
+	
+	if (key == NULL || !translate_languages_indexed)
+		return NULL;
+	
+	slot = translate_hash_bytes(TRANSLATE_HASH_INIT, key, strlen(key)) & (TRANSLATE_LANGUAGE_SLOTS - 1);
+	while (index[slot].key != NULL)
+	{
+		if (g_str_equal(index[slot].key, key))
+			return index[slot].language;
+		slot = (slot + 1) & (TRANSLATE_LANGUAGE_SLOTS - 1);
+	}
+	
+	return NULL;
+}
+
+static void
+translate_languages_init(void)
+{
+	const TranslateLanguage *language;
+	guint i;
+	
+	if (translate_languages_indexed)
+		return;
+	
+	for(i = 0; i < G_N_ELEMENTS(translate_languages); i++)
+	{
+		translate_language_index_add(translate_language_codes, translate_languages[i].code, &translate_languages[i]);
+		translate_language_index_add(translate_language_names, translate_languages[i].name, &translate_languages[i]);
+	}
+	translate_languages_indexed = TRUE;
+	
+	for(i = 0; i < G_N_ELEMENTS(translate_language_aliases); i++)
+	{
+		language = translate_language_index_find(translate_language_codes, translate_language_aliases[i].code);
+		if (language != NULL)
+			translate_language_index_add(translate_language_codes, translate_language_aliases[i].alias, language);
+	}
+}
+
+/** Finds a language by its code or any of its aliases */
+static const TranslateLanguage *
+translate_language_find(const gchar *code)
+{
+	return translate_language_index_find(translate_language_codes, code);
+}
+
+/** Turns whatever a service or locale called a language (a code, an alias or
+  * its English name) into our code for it, or an interned copy if it's unknown.
+  * Either way the result lives forever, so it can be kept without copying */
+static const gchar *
+translate_language_canonical(const gchar *code)
+{
+	const TranslateLanguage *language;
+	
+	if (code == NULL)
+		return NULL;
+	
+	language = translate_language_find(code);
+	if (language == NULL)
+		language = translate_language_index_find(translate_language_names, code);
+	
+	return language ? language->code : g_intern_string(code);
+}
+
+const gchar *
+get_language_name(const gchar *language_key)
+{
+	const TranslateLanguage *language = translate_language_find(language_key);
+	
+	return language ? language->name : NULL;
+}
+
+static guint32
+translate_db_read_uint32(const gchar *data)
+{
+	guint32 value;
+	
+	memcpy(&value, data, sizeof(value));
+	return GUINT32_FROM_LE(value);
+}
+
+/** Validates the record at offset, returning its total length or 0 if it is
+  * truncated or corrupt (eg. the client died half way through writing it) */
+static gsize
+translate_db_parse_record(const gchar *data, gsize length, gsize offset, const gchar **key, guint32 *key_len, const gchar **value, guint32 *value_len)
+{
+	guint32 klen, vlen, checksum;
+	
+	if (offset + TRANSLATE_DB_RECORD_HEADER_LEN > length)
+		return 0;
+	
+	klen = translate_db_read_uint32(data + offset);
+	vlen = translate_db_read_uint32(data + offset + 4);
+	checksum = translate_db_read_uint32(data + offset + 8);
+	
+	if (klen > length || vlen > length || offset + TRANSLATE_DB_RECORD_HEADER_LEN + klen + vlen > length)
+		return 0;
+	
+	data += offset + TRANSLATE_DB_RECORD_HEADER_LEN;
+	if (translate_hash_bytes(TRANSLATE_HASH_INIT, data, klen + vlen) != checksum)
+		return 0;
+	
+	if (key) *key = data;
+	if (key_len) *key_len = klen;
+	if (value) *value = data + klen;
+	if (value_len) *value_len = vlen;
+	
+	return TRANSLATE_DB_RECORD_HEADER_LEN + klen + vlen;
+}
+
+static gboolean
+translate_db_write_record(FILE *file, const gchar *key, const gchar *translated_phrase, const gchar *detected_language)
+{
+	guint32 header[3];
+	GString *value;
+	gsize key_len = strlen(key);
+	gboolean success;
+	
+	value = g_string_new(translated_phrase);
+	g_string_append_c(value, '\0');
+	if (detected_language)
+		g_string_append(value, detected_language);
+	
+	header[0] = GUINT32_TO_LE(key_len);
+	header[1] = GUINT32_TO_LE(value->len);
+	header[2] = GUINT32_TO_LE(translate_hash_bytes(translate_hash_bytes(TRANSLATE_HASH_INIT, key, key_len), value->str, value->len));
+	
+	success = fwrite(header, sizeof(header), 1, file) == 1 &&
+			fwrite(key, key_len, 1, file) == 1 &&
+			fwrite(value->str, value->len, 1, file) == 1;
+	
+	g_string_free(value, TRUE);
+	
+	return success;
+}
+
+/** Flushes file and waits for it to reach the disk, so a power cut can't leave it
+  * (or a file renamed from it) empty */
+static gboolean
+translate_db_sync(FILE *file)
+{
+	if (fflush(file) != 0)
+		return FALSE;
+#ifdef _WIN32
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
+
+/** (Re)maps the log so that every record appended so far can be read */
+static gboolean
+translate_db_remap(void)
+{
+	if (translate_db_map != NULL && g_mapped_file_get_length(translate_db_map) >= translate_db_length)
+		return TRUE;
+	
+	if (translate_db_file != NULL)
+		fflush(translate_db_file);
+	if (translate_db_map != NULL)
+		g_mapped_file_unref(translate_db_map);
+	
+	translate_db_map = g_mapped_file_new(translate_db_filename, FALSE, NULL);
+	
+	return translate_db_map != NULL;
+}
+
+static void
+translate_db_close(void)
+{
+	if (translate_db_file != NULL)
+	{
+		// Appends are only flushed as they happen, so make them last at least this far
+		if (!translate_db_sync(translate_db_file))
+			purple_debug_error("translate", "Could not sync translation memory %s\n", translate_db_filename);
+		fclose(translate_db_file);
+	}
+	translate_db_file = NULL;
+	
+	if (translate_db_map != NULL)
+		g_mapped_file_unref(translate_db_map);
+	translate_db_map = NULL;
+	
+	if (translate_db_index != NULL)
+		g_hash_table_destroy(translate_db_index);
+	translate_db_index = NULL;
+	if (translate_db_collisions != NULL)
+		g_hash_table_destroy(translate_db_collisions);
+	translate_db_collisions = NULL;
+	
+	translate_db_length = 0;
+	translate_db_dead = 0;
+	translate_db_opened = FALSE;
+}
+
+static gint
+translate_db_compare_offsets(gconstpointer a, gconstpointer b)
+{
+	gsize offset_a = GPOINTER_TO_UINT(a);
+	gsize offset_b = GPOINTER_TO_UINT(b);
+	
+	return (offset_a < offset_b) ? 1 : (offset_a > offset_b) ? -1 : 0;
+}
+
+static gboolean translate_db_open(void);
+
+/** Points key's entry in the index at the record at offset, counting the record it
+  * replaces as dead.  data is the mapped log the older records can be read from, or
+  * NULL if it couldn't be mapped */
+static void
+translate_db_index_set(const gchar *data, gsize length, const gchar *key, guint32 key_len, gsize offset)
+{
+	guint32 hash = translate_hash_bytes(TRANSLATE_HASH_INIT, key, key_len);
+	const gchar *old_key;
+	guint32 old_key_len;
+	gsize old_len = 0;
+	gpointer old_offset;
+	gchar *full_key;
+	
+	if (!g_hash_table_lookup_extended(translate_db_index, GUINT_TO_POINTER(hash), NULL, &old_offset))
+	{
+		g_hash_table_insert(translate_db_index, GUINT_TO_POINTER(hash), GUINT_TO_POINTER(offset));
+		return;
+	}
+	
+	if (data != NULL)
+		old_len = translate_db_parse_record(data, length, GPOINTER_TO_UINT(old_offset), &old_key, &old_key_len, NULL, NULL);
+	if (!old_len || (old_key_len == key_len && memcmp(old_key, key, key_len) == 0))
+	{
+		translate_db_dead += old_len;
+		g_hash_table_insert(translate_db_index, GUINT_TO_POINTER(hash), GUINT_TO_POINTER(offset));
+		return;
+	}
+	
+	// A different key with the same hash, so this one goes by its whole key
+	full_key = g_strndup(key, key_len);
+	if (g_hash_table_lookup_extended(translate_db_collisions, full_key, NULL, &old_offset))
+		translate_db_dead += translate_db_parse_record(data, length, GPOINTER_TO_UINT(old_offset), NULL, NULL, NULL, NULL);
+	g_hash_table_replace(translate_db_collisions, full_key, GUINT_TO_POINTER(offset));
+}
+
+/** Rewrites the log with only the newest record for each key, dropping the oldest
+  * records until it is at most half of the size limit.  The new log is written to
+  * a temporary file, synced to disk and only then renamed over the old one, so a
+  * crash or power cut leaves one log or the other */
+static void
+translate_db_compact(void)
+{
+	gchar *temp_filename;
+	FILE *temp_file;
+	GList *offsets, *l, *keep = NULL;
+	const gchar *data;
+	gsize budget, used = TRANSLATE_DB_HEADER_LEN, record_len;
+	gboolean success = TRUE;
+	
+	if (!translate_db_remap())
+		return;
+	
+	budget = translate_config.store_size / 2;
+	data = g_mapped_file_get_contents(translate_db_map);
+	
+	offsets = g_list_concat(g_hash_table_get_values(translate_db_index), g_hash_table_get_values(translate_db_collisions));
+	offsets = g_list_sort(offsets, translate_db_compare_offsets);
+	for(l = offsets; l; l = l->next)
+	{
+		record_len = translate_db_parse_record(data, translate_db_length, GPOINTER_TO_UINT(l->data), NULL, NULL, NULL, NULL);
+		if (!record_len)
+			continue;
+		if (used + record_len > budget)
+			break;
+		used += record_len;
+		keep = g_list_prepend(keep, l->data);
+	}
+	g_list_free(offsets);
+	
+	temp_filename = g_strdup_printf("%s.tmp", translate_db_filename);
+	temp_file = g_fopen(temp_filename, "wb");
+	if (temp_file == NULL)
+	{
+		g_list_free(keep);
+		g_free(temp_filename);
+		return;
+	}
+	
+	success = fwrite(TRANSLATE_DB_MAGIC, TRANSLATE_DB_HEADER_LEN, 1, temp_file) == 1;
+	for(l = keep; success && l; l = l->next)
+	{
+		record_len = translate_db_parse_record(data, translate_db_length, GPOINTER_TO_UINT(l->data), NULL, NULL, NULL, NULL);
+		success = fwrite(data + GPOINTER_TO_UINT(l->data), record_len, 1, temp_file) == 1;
+	}
+	g_list_free(keep);
+	
+	success = success && translate_db_sync(temp_file);
+	success = (fclose(temp_file) == 0) && success;
+	
+	purple_debug_info("translate", "Compacted translation memory from %" G_GSIZE_FORMAT " to %" G_GSIZE_FORMAT " bytes\n",
+					translate_db_length, used);
+	
+	translate_db_close();
+	if (!success || g_rename(temp_filename, translate_db_filename) != 0)
+	{
+		purple_debug_error("translate", "Could not compact translation memory %s\n", translate_db_filename);
+		g_unlink(temp_filename);
+		g_free(temp_filename);
+		
+		// Leave it closed for this session rather than keep appending to a bad log
+		translate_db_opened = TRUE;
+		return;
+	}
+	g_free(temp_filename);
+	
+	translate_db_open();
+}
+
+/** Maps the translation memory and indexes its records.  Only done the first time
+  * a lookup needs it, so the plugin loads just as quickly as before */
+static gboolean
+translate_db_open(void)
+{
+	const gchar *data;
+	const gchar *key;
+	guint32 key_len;
+	gsize length, offset, record_len;
+	
+	if (translate_db_opened)
+		return translate_db_index != NULL;
+	translate_db_opened = TRUE;
+	
+	if (translate_db_filename == NULL)
+		return FALSE;
+	
+	translate_db_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+	translate_db_collisions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	translate_db_length = TRANSLATE_DB_HEADER_LEN;
+	
+	translate_db_map = g_mapped_file_new(translate_db_filename, FALSE, NULL);
+	if (translate_db_map != NULL)
+	{
+		data = g_mapped_file_get_contents(translate_db_map);
+		length = g_mapped_file_get_length(translate_db_map);
+		
+		if (length < TRANSLATE_DB_HEADER_LEN || memcmp(data, TRANSLATE_DB_MAGIC, TRANSLATE_DB_HEADER_LEN) != 0)
+		{
+			purple_debug_warning("translate", "Discarding unrecognised translation memory %s\n", translate_db_filename);
+			g_mapped_file_unref(translate_db_map);
+			translate_db_map = NULL;
+			g_unlink(translate_db_filename);
+		} else {
+			offset = TRANSLATE_DB_HEADER_LEN;
+			while ((record_len = translate_db_parse_record(data, length, offset, &key, &key_len, NULL, NULL)))
+			{
+				translate_db_index_set(data, length, key, key_len, offset);
+				offset += record_len;
+			}
+			translate_db_length = offset;
+			
+			if (offset != length)
+			{
+				// A partially written record from a crash; rewrite without it
+				purple_debug_warning("translate", "Translation memory has %" G_GSIZE_FORMAT " bytes of trailing garbage\n", length - offset);
+				translate_db_compact();
+				return translate_db_index != NULL;
+			}
+		}
+	}
+	
+	translate_db_file = g_fopen(translate_db_filename, "ab");
+	if (translate_db_file == NULL)
+	{
+		purple_debug_error("translate", "Could not open translation memory %s\n", translate_db_filename);
+		translate_db_close();
+		translate_db_opened = TRUE;
+		return FALSE;
+	}
+	if (translate_db_map == NULL)
+	{
+		fwrite(TRANSLATE_DB_MAGIC, TRANSLATE_DB_HEADER_LEN, 1, translate_db_file);
+		fflush(translate_db_file);
+	}
+	
+	purple_debug_info("translate", "Opened translation memory with %u entries\n",
+					g_hash_table_size(translate_db_index) + g_hash_table_size(translate_db_collisions));
+	
+	return TRUE;
+}
+
+static gboolean
+translate_db_lookup(const gchar *cache_key, gchar **translated_phrase, const gchar **detected_language)
+{
+	gpointer offset;
+	const gchar *data, *key, *value;
+	gchar *language;
+	guint32 key_len, value_len, hash;
+	gsize key_length = strlen(cache_key);
+	
+	if (!translate_db_open())
+		return FALSE;
+	
+	hash = translate_hash_bytes(TRANSLATE_HASH_INIT, cache_key, key_length);
+	if (!g_hash_table_lookup_extended(translate_db_index, GUINT_TO_POINTER(hash), NULL, &offset))
+		return FALSE;
+	
+	if (!translate_db_remap())
+		return FALSE;
+	data = g_mapped_file_get_contents(translate_db_map);
+	
+	if (!translate_db_parse_record(data, translate_db_length, GPOINTER_TO_UINT(offset), &key, &key_len, &value, &value_len))
+		return FALSE;
+	
+	if (key_len != key_length || memcmp(key, cache_key, key_len) != 0)
+	{
+		// Another key has this one's hash, so it's indexed by the whole key
+		if (!g_hash_table_lookup_extended(translate_db_collisions, cache_key, NULL, &offset) ||
+			!translate_db_parse_record(data, translate_db_length, GPOINTER_TO_UINT(offset), &key, &key_len, &value, &value_len) ||
+			key_len != key_length || memcmp(key, cache_key, key_len) != 0)
+			return FALSE;
+	}
+	
+	// A record can pass its checksum and still have been written wrong
+	if (memchr(value, '\0', value_len) == NULL)
+		return FALSE;
+	
+	*translated_phrase = g_strndup(value, value_len);
+	value_len -= strlen(*translated_phrase) + 1;
+	*detected_language = NULL;
+	if (value_len)
+	{
+		language = g_strndup(value + strlen(*translated_phrase) + 1, value_len);
+		*detected_language = translate_language_canonical(language);
+		g_free(language);
+	}
+	
+	return TRUE;
+}
+
+static void
+translate_db_insert(const gchar *cache_key, const gchar *translated_phrase, const gchar *detected_language)
+{
+	gsize record_len;
+	gsize max_size;
+	
+	if (!translate_db_open())
+		return;
+	
+	record_len = TRANSLATE_DB_RECORD_HEADER_LEN + strlen(cache_key) + strlen(translated_phrase) + 1 +
+					(detected_language ? strlen(detected_language) : 0);
+	
+	if (!translate_db_write_record(translate_db_file, cache_key, translated_phrase, detected_language) ||
+		fflush(translate_db_file) != 0)
+	{
+		purple_debug_error("translate", "Could not write to translation memory %s\n", translate_db_filename);
+		
+		// Part of the record may be in the log, so nothing appended after it could be
+		// found again.  Leave it closed for this session; the next open drops the rest
+		translate_db_close();
+		translate_db_opened = TRUE;
+		return;
+	}
+	
+	translate_db_index_set(translate_db_remap() ? g_mapped_file_get_contents(translate_db_map) : NULL, translate_db_length,
+					cache_key, strlen(cache_key), translate_db_length);
+	translate_db_length += record_len;
+	
+	max_size = translate_config.store_size;
+	if (translate_db_length > max_size || translate_db_dead > translate_db_length / 2)
+		translate_db_compact();
+}
+
+/** Stores that have been finished with, kept to save going back to malloc */
+static struct _TranslateStore *translate_store_pool = NULL;
+static guint translate_store_pool_size = 0;
+
+static struct _TranslateStore *
+translate_store_new(const gchar *service, const gchar *plain_phrase, const gchar *from_lang, const gchar *to_lang, TranslateCallback callback, gpointer userdata)
+{
+	struct _TranslateStore *store;
+	TranslateArena arena;
+	gsize phrase_len = strlen(plain_phrase);
+	
+	store = translate_store_pool;
+	if (store != NULL)
+	{
+		translate_store_pool = store->next_free;
+		translate_store_pool_size--;
+		translate_pool_reused++;
+		
+		arena = store->arena;
+		memset(store, 0, sizeof(struct _TranslateStore));
+		store->arena = arena;
+	} else {
+		store = g_new0(struct _TranslateStore, 1);
+	}
+	
+	// Room for the phrase, its cache key and most translations of it
+	translate_arena_reserve(&store->arena, phrase_len * 4 + 64);
+	store->original_phrase = translate_arena_strdup(&store->arena, plain_phrase);
+	store->callback = callback;
+	store->userdata = userdata;
+	store->cache_key = translate_cache_make_key(&store->arena, service, from_lang, to_lang, plain_phrase);
+	
+	return store;
+}
+
+static void
+translate_store_free(struct _TranslateStore *store)
+{
+	translate_arena_reset(&store->arena);
+	
+	if (translate_store_pool_size >= TRANSLATE_POOL_MAX)
+	{
+		translate_arena_free(&store->arena);
+		g_free(store);
+		return;
+	}
+	
+	store->next_free = translate_store_pool;
+	translate_store_pool = store;
+	translate_store_pool_size++;
+}
+
+/** Hands the result (or error) to whoever asked for it, including any identical
+  * requests that were waiting on this one, remembers it for next time and frees the store */
+static void
+translate_store_finish(struct _TranslateStore *store, const gchar *translated_phrase, const gchar *detected_language, const gchar *error_message)
+{
+	struct _TranslateStore *waiter;
+	GSList *l;
+	
+	detected_language = translate_language_canonical(detected_language);
+	
+	if (translate_inflight != NULL && g_hash_table_lookup(translate_inflight, store->cache_key) == store)
+		g_hash_table_remove(translate_inflight, store->cache_key);
+	
+	if (!store->no_store && translated_phrase)
+	{
+		translate_cache_insert(store->cache_key, translated_phrase, detected_language);
+		translate_db_insert(store->cache_key, translated_phrase, detected_language);
+	}
+	
+	store->callback(store->original_phrase, translated_phrase, detected_language, error_message, store->userdata);
+	
+	store->waiters = g_slist_reverse(store->waiters);
+	for(l = store->waiters; l; l = l->next)
+	{
+		waiter = l->data;
+		waiter->callback(waiter->original_phrase, translated_phrase, detected_language, error_message, waiter->userdata);
+		translate_store_free(waiter);
+	}
+	g_slist_free(store->waiters);
+	store->waiters = NULL;
+	
+	translate_store_free(store);
+}
+
+static void
+translate_store_complete(struct _TranslateStore *store, const gchar *translated_phrase, const gchar *detected_language)
+{
+	translate_store_finish(store, translated_phrase, detected_language, NULL);
+}
+
+/** Gives up on a store, handing back the original phrase so the message isn't lost */
+static void
+translate_store_fail(struct _TranslateStore *store, const gchar *error_message)
+{
+	store->no_store = TRUE;
+	translate_store_finish(store, store->original_phrase, NULL, error_message);
+}
+
+/** Stores answered without going to the network, waiting for the main loop so that
+  * callers see the same ordering as a network reply */
+static GQueue translate_deliveries = G_QUEUE_INIT;
+static guint translate_deliveries_timer = 0;
+
+static gboolean
+translate_deliveries_cb(gpointer userdata)
+{
+	struct _TranslateStore *store;
+	
+	translate_deliveries_timer = 0;
+	while ((store = g_queue_pop_head(&translate_deliveries)))
+		translate_store_finish(store, store->translated_phrase, store->detected_language, store->error_message);
+	
+	return FALSE;
+}
+
+/** Completes a store with its translated_phrase (or error_message) from the main loop */
+static void
+translate_store_deliver(struct _TranslateStore *store)
+{
+	g_queue_push_tail(&translate_deliveries, store);
+	if (!translate_deliveries_timer)
+		translate_deliveries_timer = purple_timeout_add(0, translate_deliveries_cb, NULL);
+}
+
+/** Hands over everything waiting to be delivered straight away, for unloading */
+static void
+translate_deliveries_flush(void)
+{
+	if (translate_deliveries_timer)
+		purple_timeout_remove(translate_deliveries_timer);
+	translate_deliveries_cb(NULL);
+}
+
+/** Checks the cache, then the translation memory, for the store's phrase.  On a hit the
+  * callback is run from the main loop (so callers see the same ordering as a network
+  * reply) and TRUE is returned */
+static gboolean
+translate_cache_lookup(struct _TranslateStore *store)
+{
+	struct _TranslateCacheEntry *entry = NULL;
+	gchar *translated_phrase;
+	
+	if (translate_cache != NULL)
+		entry = g_hash_table_lookup(translate_cache, store->cache_key);
+	
+	if (entry != NULL)
+	{
+		translate_cache_hits++;
+		g_queue_unlink(&translate_cache_lru, entry->link);
+		g_queue_push_head_link(&translate_cache_lru, entry->link);
+		
+		store->translated_phrase = translate_arena_strdup(&store->arena, entry->translated_phrase);
+		store->detected_language = entry->detected_language;
+	} else if (translate_db_lookup(store->cache_key, &translated_phrase, &store->detected_language)) {
+		translate_db_hits++;
+		translate_cache_insert(store->cache_key, translated_phrase, store->detected_language);
+		store->translated_phrase = translate_arena_strdup(&store->arena, translated_phrase);
+		g_free(translated_phrase);
+	} else {
+		translate_cache_misses++;
+		return FALSE;
+	}
+	
+	store->no_store = TRUE;
+	
+	translate_store_deliver(store);
+	
+	return TRUE;
+}
+
+static gboolean translate_store_dispatched(struct _TranslateStore *store);
+
+/** If the same phrase is already being fetched, queue the store up behind that
+  * request and return TRUE.  Otherwise the store becomes the one being fetched */
+static gboolean
+translate_inflight_join(struct _TranslateStore *store)
+{
+	struct _TranslateStore *leader;
+	
+	if (translate_inflight == NULL)
+		translate_inflight = g_hash_table_new(g_str_hash, g_str_equal);
+	
+	leader = g_hash_table_lookup(translate_inflight, store->cache_key);
+	
+	// A draft still queued behind everything else mustn't hold up a real message,
+	// so the message goes ahead on its own and takes over as the one being fetched
+	if (leader != NULL && leader->priority == TRANSLATE_PRIORITY_SPECULATIVE &&
+			store->priority != TRANSLATE_PRIORITY_SPECULATIVE && !translate_store_dispatched(leader))
+		leader = NULL;
+	
+	if (leader != NULL)
+	{
+		translate_inflight_joined++;
+		leader->waiters = g_slist_prepend(leader->waiters, store);
+		return TRUE;
+	}
+	
+	g_hash_table_replace(translate_inflight, store->cache_key, store);
+	
+	return FALSE;
+}
+
+/** Compact character trigram profiles for the Latin-script languages, most
+  * frequent first, with a space marking the start or end of a word.  Languages
+  * with their own script are recognised from the script alone */
+struct _TranslateLanguageProfile {
+	const gchar *code;
+	const gchar *trigrams;
+};
+
+static const struct _TranslateLanguageProfile translate_language_profiles[] = {
+	{"af", "ie | di|die|en |an |ek |is |nie| ni|nd |het| he|vir| ve|ver|van"},
+	{"az", "lar|ır |ar | bi|bir|və | və|ın |da |də |lər|ən |əri|ini|dır|mən"},
+	{"ca", " de|de |es |la | la|que| qu|ue |els|ent| el|és | i |per|amb|ció"},
+	{"cs", " pr| je|je |ní |ch |ost|se | se|ho |pro|na | na|to |ře |že |jak"},
+	{"cy", " yn|yn |dd |ydd|au |ae | a |wch| y |ych| ei|ich|edd|oed|ar |eth"},
+	{"da", "er |en | de|et |der|de |og | og|for| fo|jeg| je|ikk|ke |det|at "},
+	{"de", "en |er |der|ie |ich| di|die|ein|sch|che|und| un|nd |ch |den| ei"},
+	{"en", " th|the|he |and| an|nd |ing| to|ng |ion|tio| of|of |is |you| yo"},
+	{"es", " de|de |os |la | la|que| qu|ue |el | el|en |es |as |ión|ado| lo"},
+	{"et", "en |ja | ja|se |st |as | on|on |le |ud |ma |ga |mis|ole|ei |oli"},
+	{"eu", "en |ak |ko |eta|ta |ren|ean|tze|tu |ban|etz|ez |bat| ba|zen|era"},
+	{"fi", "en |in |an |ta |ist|sta|on |is |sa |tä |ssa|lla|ja | ja|aan|kin"},
+	{"fr", "es | de|de |ent|le | le|ion|les|nt | la|la |que| qu|ue |est|ous"},
+	{"ga", " an|an |ach| na|na |ai |agu|gus| ag| is|is |ead|ann|cha| ar|áil"},
+	{"gl", " de|de |os |do |da | da|que| qu|ue |ón |non| no|nos|ent|con|cos"},
+	{"hr", "je | je|na | na| i |da | da|ti |se | se|sam|ako|ija|nje|što|ni "},
+	{"ht", "ou | ou|an |en |li | li|mwe|pou| po|ki | ki|yo |nan|se | se|pa "},
+	{"hu", "en |sz |az | az|ek |gy |egy| eg|ak |és | és|nem| ne|hog|ogy|van"},
+	{"id", "an |ang|ng | me|kan|yan|nya|ya |dan| da|men| ya|aka|ada|ter|ini"},
+	{"is", "að | að|ur |ega|nn |inn|og | og|ir |um |er |ég |ekk|kki|ki |var"},
+	{"it", " di|di |to |la | la|che| ch|he |re |ell|lla|one|ato|no |per|del"},
+	{"la", "um |us | et|et |is |em |ere|que|ae |ent| in|in |tur|am |it |est"},
+	{"lt", "as |is |ai | ir|ir |us |ių |tai|kad| ka|os |ti |ar |ės |šk|ski"},
+	{"lv", "as | un|un |ir | ir|ja |es |is |ās |em |ka |ies|bet|nav| ne|ais"},
+	{"ms", "an |ang|ng | me|kan|yan|nya|ya |dan| da|ada| ak|aku|lah|ah |ini"},
+	{"mt", " il|il |li | li|ta | ta|tal|ħa |ja |ien|kie|jie|ssa|hom|mil|ħal"},
+	{"nl", "en |de | de|an |et |van| va|het| he|een| ee|ij |aar|ijk|oor|ver"},
+	{"no", "er |en | de|et |og | og|det|for| fo|jeg|ikk|ke |ne |til| ti|som"},
+	{"pl", "ie |nie| ni|ch |ego|owa|wa |ię |się| si|em |ać |na | na| pr|prz"},
+	{"pt", " de|de |os |ão |do |que| qu|ue | da|da |ent| co|ar |ção|não|em "},
+	{"ro", " de|de |și | și|re |ul |ea |în | în|are|ste|est| ca|ca |lor|că "},
+	{"sk", " pr|je | je|ch |na | na|ie |ost|sa | sa|ho |to |pre|ako|že |ova"},
+	{"sl", "je | je| in|in |na | na|da | da|ti |pa | pa|ki |se | se|sem|kaj"},
+	{"sq", "të | të|në | në| e |dhe| dh|he |për| pë|një| nj|ësh|sht|ka |ër "},
+	{"sv", "en | oc|och|ch |er |att| at|tt |ar |det|för|de |and|jag| ja|är "},
+	{"sw", " ku|wa | wa|na | na|ya | ya|ni |ka |ana|kwa|za |ali|ind|ata|ili"},
+	{"tl", "ng | ng| sa|sa |ang| an| na|na |ga |mga| mg|ay |ko | ko|iya|ala"},
+	{"tr", "lar|ler| bi|bir|ir |in |an |en |eri|ın |de |da |yor|iyo|ını|ve "},
+	{"vi", "ng |nh | th| kh| ng|ông|ột|ác |ủa| củ|là | là|có | có|ược|ời "},
+};
+
+/** Letters that only turn up in a handful of languages, and which ones */
+static const struct {
+	gunichar letter;
+	const gchar *codes;
+} translate_language_letters[] = {
+	{0x00F1, "es gl"}, {0x00E3, "pt vi"}, {0x00F5, "pt et vi"}, {0x00DF, "de"},
+	{0x00E5, "sv da no"}, {0x00F8, "da no"}, {0x00E6, "da no is"}, {0x0151, "hu"},
+	{0x0171, "hu"}, {0x0142, "pl"}, {0x0105, "pl lt"}, {0x0119, "pl lt"},
+	{0x0159, "cs"}, {0x016F, "cs"}, {0x011B, "cs"}, {0x013E, "sk"},
+	{0x0219, "ro"}, {0x021B, "ro"}, {0x0103, "ro vi"}, {0x011F, "tr az"},
+	{0x015F, "tr az"}, {0x0131, "tr az"}, {0x0259, "az"}, {0x0101, "lv"},
+	{0x0113, "lv"}, {0x012B, "lv"}, {0x016B, "lv lt"}, {0x0137, "lv"},
+	{0x0117, "lt"}, {0x012F, "lt"}, {0x0173, "lt"}, {0x0175, "cy"},
+	{0x0177, "cy"}, {0x0127, "mt"}, {0x0121, "mt"}, {0x00F0, "is"},
+	{0x00FE, "is"}, {0x0111, "hr vi"}, {0x01A1, "vi"}, {0x01B0, "vi"},
+	{0x00EB, "sq"}, {0x00E7, "fr pt ca sq tr az"}, {0x00E8, "fr it ca ht"},
+	{0x00E4, "de fi et sv sk"}, {0x00F6, "de fi et sv hu tr az is"},
+	{0x00FC, "de hu tr az et"}, {0x00F2, "ht it ca"}, {0x00EA, "fr pt vi"},
+};
+
+/** trigram -> GSList of packed (profile index << 8 | weight), built on first use */
+static GHashTable *translate_language_trigrams = NULL;
+
+static void
+translate_language_trigrams_free(gpointer data)
+{
+	g_slist_free(data);
+}
+
+static void
+translate_language_trigrams_build(void)
+{
+	guint i, j;
+	gchar **trigrams;
+	guint count;
+	GSList *weights;
+	gchar *key;
+	
+	translate_language_trigrams = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, translate_language_trigrams_free);
+	
+	for(i = 0; i < G_N_ELEMENTS(translate_language_profiles); i++)
+	{
+		trigrams = g_strsplit(translate_language_profiles[i].trigrams, "|", -1);
+		count = g_strv_length(trigrams);
+		for(j = 0; j < count; j++)
+		{
+			weights = NULL;
+			if (g_hash_table_lookup_extended(translate_language_trigrams, trigrams[j], (gpointer *)&key, (gpointer *)&weights))
+				g_hash_table_steal(translate_language_trigrams, key);
+			else
+				key = g_strdup(trigrams[j]);
+			
+			weights = g_slist_prepend(weights, GUINT_TO_POINTER((i << 8) | (count - j)));
+			g_hash_table_insert(translate_language_trigrams, key, weights);
+		}
+		g_strfreev(trigrams);
+	}
+}
+
+/** Works out which language a text in a script other than Latin is in, or NULL
+  * for Latin and anything ambiguous.  letters is set to the number of letters in
+  * the text and script_letters to how many of them were in the winning script */
+static const gchar *
+translate_detect_script(const gchar *text, guint *letters, guint *script_letters)
+{
+	gunichar c;
+	guint hangul = 0, kana = 0, han = 0, thai = 0, georgian = 0, armenian = 0;
+	guint greek = 0, hebrew = 0, arabic = 0, devanagari = 0, cyrillic = 0;
+	guint yiddish = 0, persian = 0, urdu = 0, traditional = 0, simplified = 0;
+	guint ru = 0, uk = 0, be = 0, bg = 0, mk = 0, sr = 0, serbo_macedonian = 0;
+	guint best = 0;
+	const gchar *code = NULL;
+	gchar utf8[7];
+	
+	*letters = 0;
+	for(; *text; text = g_utf8_next_char(text))
+	{
+		c = g_utf8_get_char(text);
+		if (!g_unichar_isalpha(c))
+			continue;
+		(*letters)++;
+		
+		if ((c >= 0xAC00 && c <= 0xD7AF) || (c >= 0x1100 && c <= 0x11FF) || (c >= 0x3130 && c <= 0x318F))
+			hangul++;
+		else if (c >= 0x3040 && c <= 0x30FF)
+			kana++;
+		else if (c >= 0x4E00 && c <= 0x9FFF)
+		{
+			han++;
+			utf8[g_unichar_to_utf8(c, utf8)] = '\0';
+			if (strstr("這個們說為會來時對國學發後麼見經門開與還", utf8))
+				traditional++;
+			else if (strstr("这个们说为会来时对国学发后么见经门开与还", utf8))
+				simplified++;
+		}
+		else if (c >= 0x0E00 && c <= 0x0E7F)
+			thai++;
+		else if (c >= 0x10A0 && c <= 0x10FF)
+			georgian++;
+		else if (c >= 0x0530 && c <= 0x058F)
+			armenian++;
+		else if (c >= 0x0370 && c <= 0x03FF)
+			greek++;
+		else if (c >= 0x0590 && c <= 0x05FF)
+		{
+			hebrew++;
+			if (c >= 0x05F0 && c <= 0x05F2)
+				yiddish++;
+		}
+		else if (c >= 0x0600 && c <= 0x06FF)
+		{
+			arabic++;
+			if (c == 0x067E || c == 0x0686 || c == 0x0698 || c == 0x06AF || c == 0x06CC || c == 0x06A9)
+				persian++;
+			if (c == 0x0679 || c == 0x0688 || c == 0x0691 || c == 0x06BA || c == 0x06D2 || c == 0x06C1)
+				urdu++;
+		}
+		else if (c >= 0x0900 && c <= 0x097F)
+			devanagari++;
+		else if (c >= 0x0400 && c <= 0x04FF)
+		{
+			cyrillic++;
+			switch(c)
+			{
+				case 0x044B: case 0x044D: case 0x0451: ru++; break; // ы э ё
+				case 0x0457: case 0x0454: case 0x0491: uk++; break; // ї є ґ
+				case 0x0456: uk++; be++; break; // і
+				case 0x045E: be += 2; break; // ў
+				case 0x044A: bg++; break; // ъ
+				case 0x0453: case 0x045C: case 0x0455: mk++; break; // ѓ ќ ѕ
+				case 0x0452: case 0x045B: sr++; break; // ђ ћ
+				case 0x0458: case 0x0459: case 0x045A: case 0x045F: serbo_macedonian++; break; // ј љ њ џ
+			}
+		}
+	}
+	
+#define translate_detect_pick(count, language) \
+	if ((count) > best) { best = (count); code = (language); }
+	
+	translate_detect_pick(hangul, "ko");
+	translate_detect_pick(kana, "ja");
+	translate_detect_pick(han, "zh-CN");
+	translate_detect_pick(thai, "th");
+	translate_detect_pick(georgian, "ka");
+	translate_detect_pick(armenian, "hy");
+	translate_detect_pick(greek, "el");
+	translate_detect_pick(hebrew, yiddish ? "yi" : "iw");
+	translate_detect_pick(arabic, urdu > persian ? "ur" : persian ? "fa" : "ar");
+	translate_detect_pick(devanagari, "hi");
+	translate_detect_pick(cyrillic, NULL);
+	
+	// Kanji mixed in with kana is still Japanese
+	if (code && g_str_equal(code, "zh-CN") && kana)
+		code = "ja";
+	if (code && g_str_equal(code, "zh-CN") && traditional > simplified)
+		code = "zh-TW";
+	
+	if (best == cyrillic && cyrillic)
+	{
+		// Tell the Cyrillic languages apart by the letters only some of them use
+		code = NULL;
+		if (be && be > uk)
+			code = "be";
+		else if (uk)
+			code = "uk";
+		else if (mk)
+			code = "mk";
+		else if (sr || serbo_macedonian)
+			code = "sr";
+		else if (ru)
+			code = "ru";
+		else if (bg)
+			code = "bg";
+	}
+	
+	*script_letters = best;
+	return code;
+}
+
+/** Scores a Latin-script text against each trigram profile, returning the best
+  * language and setting confidence to how far ahead of the runner up it is */
+static const gchar *
+translate_detect_latin(const gchar *text, gdouble *confidence)
+{
+	gdouble scores[G_N_ELEMENTS(translate_language_profiles)];
+	gunichar window[3] = {' ', ' ', ' '};
+	gchar trigram[19];
+	gchar *pos;
+	gunichar c;
+	GSList *weights;
+	guint i, j, best = 0, second = 0;
+	const gchar *codes;
+	gsize code_len;
+	
+	if (translate_language_trigrams == NULL)
+		translate_language_trigrams_build();
+	
+	memset(scores, 0, sizeof(scores));
+	
+	for(;; text = g_utf8_next_char(text))
+	{
+		c = *text ? g_unichar_tolower(g_utf8_get_char(text)) : ' ';
+		if (!g_unichar_isalpha(c))
+			c = ' ';
+		if (c == ' ' && window[2] == ' ')
+		{
+			if (!*text)
+				break;
+			continue;
+		}
+		
+		window[0] = window[1];
+		window[1] = window[2];
+		window[2] = c;
+		
+		if (window[1] != ' ' || window[0] != ' ')
+		{
+			pos = trigram;
+			for(j = 0; j < 3; j++)
+				pos += g_unichar_to_utf8(window[j], pos);
+			*pos = '\0';
+			
+			for(weights = g_hash_table_lookup(translate_language_trigrams, trigram); weights; weights = weights->next)
+				scores[GPOINTER_TO_UINT(weights->data) >> 8] += GPOINTER_TO_UINT(weights->data) & 0xFF;
+		}
+		
+		for(i = 0; c != ' ' && i < G_N_ELEMENTS(translate_language_letters); i++)
+		{
+			if (translate_language_letters[i].letter != c)
+				continue;
+			for(codes = translate_language_letters[i].codes; *codes; codes += code_len + (codes[code_len] == ' '))
+			{
+				code_len = strcspn(codes, " ");
+				for(j = 0; j < G_N_ELEMENTS(translate_language_profiles); j++)
+					if (strlen(translate_language_profiles[j].code) == code_len && strncmp(translate_language_profiles[j].code, codes, code_len) == 0)
+						scores[j] += 20;
+			}
+		}
+		
+		if (!*text)
+			break;
+	}
+	
+	for(i = 1; i < G_N_ELEMENTS(translate_language_profiles); i++)
+	{
+		if (scores[i] > scores[best])
+		{
+			second = best;
+			best = i;
+		} else if (i == 1 || scores[i] > scores[second]) {
+			second = i;
+		}
+	}
+	
+	// Too little to go on
+	if (scores[best] < 40)
+	{
+		*confidence = 0;
+		return NULL;
+	}
+	
+	*confidence = (scores[best] - scores[second]) / scores[best];
+	return translate_language_profiles[best].code;
+}
+
+/** Guesses the language of text without going to the network.  Returns NULL
+  * unless the guess is at least as confident as the detect_confidence pref */
+static const gchar *
+translate_detect_language(const gchar *text)
+{
+	const gchar *code;
+	guint letters, script_letters;
+	gdouble confidence = 1.0;
+	gint threshold;
+	
+	threshold = translate_config.detect_confidence;
+	if (threshold > 100)
+		return NULL;
+	
+	code = translate_detect_script(text, &letters, &script_letters);
+	if (!letters)
+		return NULL;
+	
+	if (script_letters * 2 > letters)
+		confidence = (gdouble) script_letters / letters;
+	else
+		code = translate_detect_latin(text, &confidence);
+	
+	if (code == NULL || confidence * 100 < threshold)
+		return NULL;
+	
+	purple_debug_info("translate", "Detected %s locally (%d%% confident)\n", code, (gint)(confidence * 100));
+	
+	return code;
+}
+
+/** A small HTTP/1.1 client that keeps connections to each translation service open
+  * between requests, so that a message doesn't cost a DNS lookup and a TCP handshake.
+  * Requests to a host go out over an idle connection if there is one, a new
+  * connection if there are fewer than http_max_connections, or wait their turn */
+typedef struct _TranslateHttpHost TranslateHttpHost;
+typedef struct _TranslateHttpConnection TranslateHttpConnection;
+typedef struct _TranslateHttpRequest TranslateHttpRequest;
+typedef void (*TranslateHttpCallback)(TranslateHttpRequest *request, gpointer userdata, const gchar *body, gsize len, const gchar *error_message);
+
+struct _TranslateHttpHost {
+	gchar *key;
+	gchar *hostname;
+	int port;
+	GQueue idle; //connections with nothing to do, most recently used first
+	GQueue pending; //requests waiting for a connection
+	GList *connections; //all of them, busy, idle or still connecting
+	guint dispatch_timer; //hands out new requests from the main loop
+};
+
+/** How far through a response its connection has read */
+typedef enum {
+	TRANSLATE_HTTP_HEADERS = 0,
+	TRANSLATE_HTTP_BODY, //Content-Length bytes, or everything until the server hangs up
+	TRANSLATE_HTTP_CHUNK_SIZE,
+	TRANSLATE_HTTP_CHUNK_DATA,
+	TRANSLATE_HTTP_CHUNK_END, //the line break after a chunk's data
+	TRANSLATE_HTTP_TRAILERS,
+	TRANSLATE_HTTP_DONE
+} TranslateHttpState;
+
+struct _TranslateHttpConnection {
+	TranslateHttpHost *host;
+	PurpleProxyConnectData *connect_data;
+	int fd;
+	guint input_watcher;
+	guint idle_timer;
+	TranslateHttpRequest *request;
+	GString *response; //read and not yet parsed
+	GString *body; //the response body so far, de-chunked and decompressed
+	gsize written;
+	guint requests_served;
+	
+	TranslateHttpState state;
+	guint status;
+	gboolean keep_alive;
+	gboolean has_length;
+	gsize remaining; //of the body or the current chunk
+	gboolean gzip;
+	z_stream zstream; //inflating the body as it arrives, while gzip is set
+};
+
+struct _TranslateHttpRequest {
+	TranslateHttpHost *host;
+	GString *request; //the whole request, headers and body, as it goes on the wire
+	TranslateHttpCallback callback;
+	gpointer userdata;
+	TranslateHttpConnection *connection;
+	gboolean retried;
+};
+
+#define TRANSLATE_HTTP_MAX_RESPONSE (2 * 1024 * 1024)
+
+/** Form parameters longer than this go in a POST body rather than the URL */
+#define TRANSLATE_HTTP_POST_THRESHOLD 1024
+
+static PurplePlugin *translate_plugin = NULL;
+static GHashTable *translate_http_hosts = NULL;
+static guint translate_http_connections_opened = 0;
+static guint translate_http_requests_sent = 0;
+static guint translate_http_posts_sent = 0;
+static guint64 translate_http_bytes_received = 0; //on the wire, before decompressing
+static guint64 translate_http_bytes_decoded = 0; //of response bodies, after
+
+/** Where backends build their request parameters, kept between requests */
+static GString *translate_http_scratch = NULL;
+
+static void translate_http_dispatch(TranslateHttpHost *host);
+static void translate_http_connection_send(TranslateHttpConnection *conn);
+
+static void
+translate_http_request_free(TranslateHttpRequest *request)
+{
+	g_string_free(request->request, TRUE);
+	g_free(request);
+}
+
+/** Gets the connection ready to read a new response */
+static void
+translate_http_response_reset(TranslateHttpConnection *conn)
+{
+	if (conn->gzip)
+		inflateEnd(&conn->zstream);
+	conn->gzip = FALSE;
+	conn->state = TRANSLATE_HTTP_HEADERS;
+	conn->status = 0;
+	conn->keep_alive = FALSE;
+	conn->has_length = FALSE;
+	conn->remaining = 0;
+	
+	g_string_truncate(conn->response, 0);
+	g_string_truncate(conn->body, 0);
+}
+
+static void
+translate_http_connection_close(TranslateHttpConnection *conn)
+{
+	if (conn->connect_data != NULL)
+		purple_proxy_connect_cancel(conn->connect_data);
+	if (conn->input_watcher)
+		purple_input_remove(conn->input_watcher);
+	if (conn->idle_timer)
+		purple_timeout_remove(conn->idle_timer);
+	if (conn->fd >= 0)
+		close(conn->fd);
+	if (conn->request != NULL)
+		conn->request->connection = NULL;
+	
+	g_queue_remove(&conn->host->idle, conn);
+	conn->host->connections = g_list_remove(conn->host->connections, conn);
+	
+	translate_http_response_reset(conn);
+	g_string_free(conn->response, TRUE);
+	g_string_free(conn->body, TRUE);
+	g_free(conn);
+}
+
+/** Hands the response to the request's callback and frees the request */
+static void
+translate_http_request_finish(TranslateHttpRequest *request, const gchar *body, gsize len, const gchar *error_message)
+{
+	if (request->connection != NULL)
+		request->connection->request = NULL;
+	request->connection = NULL;
+	
+	if (error_message != NULL)
+		purple_debug_error("translate", "Request to %s failed: %s\n", request->host->hostname, error_message);
+	
+	request->callback(request, request->userdata, body, len, error_message);
+	translate_http_request_free(request);
+}
+
+/** The connection failed.  A request that was sent over a reused connection is
+  * tried once more on a fresh one, since the server may have just timed it out */
+static void
+translate_http_connection_error(TranslateHttpConnection *conn, const gchar *error_message)
+{
+	TranslateHttpRequest *request = conn->request;
+	TranslateHttpHost *host = conn->host;
+	gboolean reused = conn->requests_served > 0;
+	
+	translate_http_connection_close(conn);
+	
+	if (request != NULL)
+	{
+		if (reused && !request->retried)
+		{
+			request->retried = TRUE;
+			g_queue_push_head(&host->pending, request);
+		} else {
+			translate_http_request_finish(request, NULL, 0, error_message);
+		}
+	}
+	
+	translate_http_dispatch(host);
+}
+
+static gboolean
+translate_http_idle_timeout_cb(gpointer userdata)
+{
+	TranslateHttpConnection *conn = userdata;
+	
+	conn->idle_timer = 0;
+	translate_http_connection_close(conn);
+	
+	return FALSE;
+}
+
+/** Adds some of the response body, inflating it first if it's gzipped */
+static gboolean
+translate_http_body_append(TranslateHttpConnection *conn, const gchar *data, gsize len, const gchar **error_message)
+{
+	guchar output[4096];
+	int ret;
+	
+	if (!conn->gzip)
+	{
+		g_string_append_len(conn->body, data, len);
+	} else {
+		conn->zstream.next_in = (Bytef *) data;
+		conn->zstream.avail_in = len;
+		do {
+			conn->zstream.next_out = output;
+			conn->zstream.avail_out = sizeof(output);
+			ret = inflate(&conn->zstream, Z_NO_FLUSH);
+			if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+			{
+				*error_message = "Couldn't decompress the response";
+				return FALSE;
+			}
+			g_string_append_len(conn->body, (gchar *) output, sizeof(output) - conn->zstream.avail_out);
+		} while (ret == Z_OK && (conn->zstream.avail_in > 0 || conn->zstream.avail_out == 0));
+	}
+	
+	if (conn->body->len > TRANSLATE_HTTP_MAX_RESPONSE)
+	{
+		*error_message = "Response too large";
+		return FALSE;
+	}
+	
+	return TRUE;
+}
+
+/** Reads the headers of a response, once they've all arrived */
+static gboolean
+translate_http_response_headers(TranslateHttpConnection *conn, const gchar *data, gsize len, const gchar **error_message)
+{
+	gchar *headers;
+	const gchar *value;
+	
+	headers = g_ascii_strdown(data, len);
+	
+	if (strlen(headers) > 12)
+		conn->status = atoi(headers + 9);
+	conn->keep_alive = g_str_has_prefix(headers, "http/1.1") ? (strstr(headers, "\r\nconnection: close") == NULL) :
+					(strstr(headers, "\r\nconnection: keep-alive") != NULL);
+	
+	conn->state = TRANSLATE_HTTP_BODY;
+	if ((value = strstr(headers, "\r\ncontent-length:")))
+	{
+		conn->has_length = TRUE;
+		conn->remaining = strtoul(value + 17, NULL, 10);
+	}
+	if ((value = strstr(headers, "\r\ntransfer-encoding:")) && strstr(value, "chunked") &&
+		strstr(value, "chunked") < strstr(value + 2, "\r\n"))
+		conn->state = TRANSLATE_HTTP_CHUNK_SIZE;
+	if ((value = strstr(headers, "\r\ncontent-encoding:")) && strstr(value, "gzip") &&
+		strstr(value, "gzip") < strstr(value + 2, "\r\n"))
+	{
+		// 16 + MAX_WBITS takes a gzip header rather than a zlib one
+		memset(&conn->zstream, 0, sizeof(z_stream));
+		if (inflateInit2(&conn->zstream, 16 + MAX_WBITS) != Z_OK)
+		{
+			g_free(headers);
+			*error_message = "Couldn't decompress the response";
+			return FALSE;
+		}
+		conn->gzip = TRUE;
+	}
+	g_free(headers);
+	
+	return TRUE;
+}
+
+/** Parses as much of what's been read as it can, de-chunking and inflating the body
+  * as it goes, so that only the part of the response not yet dealt with is kept.
+  * Returns TRUE once the whole response has arrived, or FALSE with error_message
+  * set if it's gone wrong */
+static gboolean
+translate_http_response_parse(TranslateHttpConnection *conn, gboolean eof, const gchar **error_message)
+{
+	const gchar *data = conn->response->str;
+	const gchar *line_end, *header_end;
+	gsize len = conn->response->len;
+	gsize pos = 0, count;
+	
+	while (conn->state != TRANSLATE_HTTP_DONE)
+	{
+		line_end = memchr(data + pos, '\n', len - pos);
+		
+		switch(conn->state)
+		{
+			case TRANSLATE_HTTP_HEADERS:
+				header_end = g_strstr_len(data, len, "\r\n\r\n");
+				if (header_end == NULL)
+					goto need_more;
+				header_end += 4;
+				if (!translate_http_response_headers(conn, data, header_end - data, error_message))
+					return FALSE;
+				pos = header_end - data;
+				if (conn->state == TRANSLATE_HTTP_BODY && conn->has_length && conn->remaining == 0)
+					conn->state = TRANSLATE_HTTP_DONE;
+				break;
+			
+			case TRANSLATE_HTTP_BODY:
+				count = len - pos;
+				if (conn->has_length)
+					count = MIN(count, conn->remaining);
+				if (!translate_http_body_append(conn, data + pos, count, error_message))
+					return FALSE;
+				pos += count;
+				if (conn->has_length)
+				{
+					conn->remaining -= count;
+					if (conn->remaining == 0)
+						conn->state = TRANSLATE_HTTP_DONE;
+				} else if (eof) {
+					// No length given, so the response ran until the server hung up
+					conn->keep_alive = FALSE;
+					conn->state = TRANSLATE_HTTP_DONE;
+				}
+				if (conn->state != TRANSLATE_HTTP_DONE)
+					goto need_more;
+				break;
+			
+			case TRANSLATE_HTTP_CHUNK_SIZE:
+				if (line_end == NULL)
+					goto need_more;
+				conn->remaining = strtoul(data + pos, NULL, 16);
+				pos = line_end + 1 - data;
+				conn->state = conn->remaining ? TRANSLATE_HTTP_CHUNK_DATA : TRANSLATE_HTTP_TRAILERS;
+				break;
+			
+			case TRANSLATE_HTTP_CHUNK_DATA:
+				count = MIN(len - pos, conn->remaining);
+				if (!translate_http_body_append(conn, data + pos, count, error_message))
+					return FALSE;
+				pos += count;
+				conn->remaining -= count;
+				if (conn->remaining)
+					goto need_more;
+				conn->state = TRANSLATE_HTTP_CHUNK_END;
+				break;
+			
+			case TRANSLATE_HTTP_CHUNK_END:
+				if (line_end == NULL)
+					goto need_more;
+				pos = line_end + 1 - data;
+				conn->state = TRANSLATE_HTTP_CHUNK_SIZE;
+				break;
+			
+			case TRANSLATE_HTTP_TRAILERS:
+				// Skip any trailers, waiting for the blank line that ends them
+				if (line_end == NULL)
+					goto need_more;
+				if (line_end == data + pos || (line_end == data + pos + 1 && data[pos] == '\r'))
+					conn->state = TRANSLATE_HTTP_DONE;
+				pos = line_end + 1 - data;
+				break;
+			
+			case TRANSLATE_HTTP_DONE:
+				break;
+		}
+	}
+	
+	// Anything after the response means we've lost track of the connection
+	if (pos < len)
+		conn->keep_alive = FALSE;
+	g_string_truncate(conn->response, 0);
+	return TRUE;
+	
+need_more:
+	g_string_erase(conn->response, 0, pos);
+	return FALSE;
+}
+
+static void
+translate_http_read_cb(gpointer userdata, gint fd, PurpleInputCondition cond)
+{
+	TranslateHttpConnection *conn = userdata;
+	TranslateHttpRequest *request = conn->request;
+	TranslateHttpHost *host = conn->host;
+	gchar buffer[4096];
+	gssize len;
+	const gchar *parse_error = NULL;
+	gchar *body_copy;
+	gsize body_len;
+	guint status;
+	gchar *error_message;
+	
+	len = read(fd, buffer, sizeof(buffer));
+	if (len < 0 && errno == EAGAIN)
+		return;
+	
+	if (request == NULL)
+	{
+		// The server closed (or spoke on) an idle connection; either way we're done with it
+		translate_http_connection_close(conn);
+		return;
+	}
+	
+	if (len < 0)
+	{
+		translate_http_connection_error(conn, g_strerror(errno));
+		return;
+	}
+	
+	g_string_append_len(conn->response, buffer, len);
+	translate_http_bytes_received += len;
+	if (conn->response->len > TRANSLATE_HTTP_MAX_RESPONSE)
+	{
+		translate_http_connection_error(conn, "Response too large");
+		return;
+	}
+	
+	if (!translate_http_response_parse(conn, len == 0, &parse_error))
+	{
+		if (parse_error != NULL)
+		{
+			translate_http_connection_error(conn, parse_error);
+		} else if (len == 0) {
+			if (conn->state == TRANSLATE_HTTP_HEADERS && conn->response->len == 0)
+				translate_http_connection_error(conn, "Server closed the connection");
+			else
+				translate_http_connection_error(conn, "Truncated response");
+		}
+		return;
+	}
+	
+	conn->requests_served++;
+	
+	// Put the connection back in the pool first, so that a request made from the
+	// callback can go straight out on it
+	body_len = conn->body->len;
+	body_copy = g_strndup(conn->body->str, body_len);
+	status = conn->status;
+	translate_http_bytes_decoded += body_len;
+	conn->request = NULL;
+	request->connection = NULL;
+	if (!conn->keep_alive || len == 0)
+	{
+		translate_http_connection_close(conn);
+	} else {
+		translate_http_response_reset(conn);
+		g_queue_push_head(&host->idle, conn);
+		conn->idle_timer = purple_timeout_add_seconds(translate_config.http_idle_timeout,
+					translate_http_idle_timeout_cb, conn);
+	}
+	
+	if (status < 200 || status >= 300)
+	{
+		error_message = g_strdup_printf("HTTP status %u", status);
+		translate_http_request_finish(request, NULL, 0, error_message);
+		g_free(error_message);
+	} else {
+		translate_http_request_finish(request, body_copy, body_len, NULL);
+	}
+	g_free(body_copy);
+	
+	translate_http_dispatch(host);
+}
+
+static void
+translate_http_write_cb(gpointer userdata, gint fd, PurpleInputCondition cond)
+{
+	TranslateHttpConnection *conn = userdata;
+	GString *request = conn->request->request;
+	gssize len;
+	
+	len = write(fd, request->str + conn->written, request->len - conn->written);
+	if (len < 0 && errno == EAGAIN)
+		return;
+	if (len <= 0)
+	{
+		translate_http_connection_error(conn, g_strerror(errno));
+		return;
+	}
+	
+	conn->written += len;
+	if (conn->written < request->len)
+		return;
+	
+	// All sent, now wait for the response
+	purple_input_remove(conn->input_watcher);
+	conn->input_watcher = purple_input_add(conn->fd, PURPLE_INPUT_READ, translate_http_read_cb, conn);
+}
+
+static void
+translate_http_connection_send(TranslateHttpConnection *conn)
+{
+	translate_http_requests_sent++;
+	
+	conn->written = 0;
+	translate_http_response_reset(conn);
+	
+	if (conn->input_watcher)
+		purple_input_remove(conn->input_watcher);
+	conn->input_watcher = purple_input_add(conn->fd, PURPLE_INPUT_WRITE, translate_http_write_cb, conn);
+	translate_http_write_cb(conn, conn->fd, PURPLE_INPUT_WRITE);
+}
+
+static void
+translate_http_connect_cb(gpointer userdata, gint source, const gchar *error_message)
+{
+	TranslateHttpConnection *conn = userdata;
+	
+	conn->connect_data = NULL;
+	
+	if (source < 0)
+	{
+		// Don't bother retrying a connection that never got anywhere
+		conn->requests_served = 0;
+		translate_http_connection_error(conn, error_message ? error_message : "Could not connect");
+		return;
+	}
+	
+	conn->fd = source;
+	translate_http_connection_send(conn);
+}
+
+/** Matches waiting requests up with idle connections, opening more if allowed */
+static void
+translate_http_dispatch(TranslateHttpHost *host)
+{
+	TranslateHttpRequest *request;
+	TranslateHttpConnection *conn;
+	gint max_connections;
+	
+	max_connections = translate_config.http_max_connections;
+	
+	while ((request = g_queue_peek_head(&host->pending)))
+	{
+		conn = g_queue_pop_head(&host->idle);
+		if (conn != NULL)
+		{
+			if (conn->idle_timer)
+				purple_timeout_remove(conn->idle_timer);
+			conn->idle_timer = 0;
+		} else if (g_list_length(host->connections) < (guint) max_connections) {
+			conn = g_new0(TranslateHttpConnection, 1);
+			conn->host = host;
+			conn->fd = -1;
+			conn->response = g_string_new(NULL);
+			conn->body = g_string_new(NULL);
+			host->connections = g_list_prepend(host->connections, conn);
+			translate_http_connections_opened++;
+		} else {
+			break;
+		}
+		
+		g_queue_pop_head(&host->pending);
+		conn->request = request;
+		request->connection = conn;
+		
+		if (conn->fd >= 0)
+		{
+			translate_http_connection_send(conn);
+		} else {
+			purple_debug_info("translate", "Opening connection %u to %s\n", g_list_length(host->connections), host->key);
+			conn->connect_data = purple_proxy_connect(translate_plugin, NULL, host->hostname, host->port, translate_http_connect_cb, conn);
+			if (conn->connect_data == NULL)
+				translate_http_connection_error(conn, "Could not connect");
+		}
+	}
+}
+
+static gboolean
+translate_http_dispatch_cb(gpointer userdata)
+{
+	TranslateHttpHost *host = userdata;
+	
+	host->dispatch_timer = 0;
+	translate_http_dispatch(host);
+	
+	return FALSE;
+}
+
+static TranslateHttpHost *
+translate_http_host_get(const gchar *hostname, int port)
+{
+	TranslateHttpHost *host;
+	gchar *key;
+	
+	if (translate_http_hosts == NULL)
+		translate_http_hosts = g_hash_table_new(g_str_hash, g_str_equal);
+	
+	key = g_strdup_printf("%s:%d", hostname, port);
+	host = g_hash_table_lookup(translate_http_hosts, key);
+	if (host != NULL)
+	{
+		g_free(key);
+		return host;
+	}
+	
+	host = g_new0(TranslateHttpHost, 1);
+	host->key = key;
+	host->hostname = g_strdup(hostname);
+	host->port = port;
+	g_hash_table_insert(translate_http_hosts, host->key, host);
+	
+	return host;
+}
+
+/** Appends text to a url or form body, percent-encoding everything but the
+  * unreserved characters.  Unlike purple_url_encode() there's no limit on how
+  * long text can be */
+static void
+translate_http_append_encoded(GString *out, const gchar *text)
+{
+	static const gchar hex[] = "0123456789ABCDEF";
+	guchar c;
+	
+	for(; *text; text++)
+	{
+		c = (guchar) *text;
+		if (g_ascii_isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~')
+		{
+			g_string_append_c(out, c);
+		} else {
+			g_string_append_c(out, '%');
+			g_string_append_c(out, hex[c >> 4]);
+			g_string_append_c(out, hex[c & 0xF]);
+		}
+	}
+}
+
+/** How long text will be once it's been through translate_http_append_encoded() */
+static gsize
+translate_http_encoded_len(const gchar *text)
+{
+	gsize len = 0;
+	guchar c;
+	
+	for(; *text; text++)
+	{
+		c = (guchar) *text;
+		if (g_ascii_isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~')
+			len += 1;
+		else
+			len += 3;
+	}
+	
+	return len;
+}
+
+/** The scratch buffer for building request parameters in, emptied.  It's only
+  * good until the next request is made */
+static GString *
+translate_http_params(void)
+{
+	// Let go of it if a big paste made it grow, rather than holding on to that for good
+	if (translate_http_scratch != NULL && translate_http_scratch->allocated_len > 64 * 1024)
+	{
+		g_string_free(translate_http_scratch, TRUE);
+		translate_http_scratch = NULL;
+	}
+	if (translate_http_scratch == NULL)
+		translate_http_scratch = g_string_sized_new(4096);
+	g_string_truncate(translate_http_scratch, 0);
+	
+	return translate_http_scratch;
+}
+
+/** Queues an http:// request on a pooled connection.  query, if given, goes on
+  * the end of the url, and form, if given, is POSTed as the body.  The whole
+  * request is built in one go straight into the buffer it's sent from.  It goes
+  * out from the main loop, so callback is never called before this returns.
+  * Returns NULL if url isn't one we can fetch */
+static TranslateHttpRequest *
+translate_http_request_new(const gchar *url, const gchar *query, const GString *form, TranslateHttpCallback callback, gpointer userdata)
+{
+	TranslateHttpRequest *request;
+	const gchar *host_start, *path;
+	gchar *hostname, *colon;
+	int port = 80;
+	gsize size;
+	
+	if (!g_str_has_prefix(url, "http://"))
+		return NULL;
+	
+	host_start = url + 7;
+	path = strchr(host_start, '/');
+	if (path != NULL)
+	{
+		hostname = g_strndup(host_start, path - host_start);
+	} else {
+		hostname = g_strdup(host_start);
+		path = "/";
+	}
+	if ((colon = strchr(hostname, ':')))
+	{
+		*colon = '\0';
+		port = atoi(colon + 1);
+	}
+	
+	size = 256 + strlen(path) + strlen(hostname);
+	if (query != NULL)
+		size += strlen(query) + 1;
+	if (form != NULL)
+		size += form->len;
+	
+	request = g_new0(TranslateHttpRequest, 1);
+	request->host = translate_http_host_get(hostname, port);
+	request->callback = callback;
+	request->userdata = userdata;
+	request->request = g_string_sized_new(size);
+	
+	g_string_append(request->request, form != NULL ? "POST " : "GET ");
+	g_string_append(request->request, path);
+	if (query != NULL)
+	{
+		g_string_append_c(request->request, strchr(path, '?') ? '&' : '?');
+		g_string_append(request->request, query);
+	}
+	g_string_append_printf(request->request, " HTTP/1.1\r\n"
+			"Host: %s\r\n"
+			"User-Agent: libpurple\r\n"
+			"Accept: */*\r\n"
+			"Accept-Encoding: gzip\r\n"
+			"Connection: keep-alive\r\n", hostname);
+	if (form != NULL)
+	{
+		translate_http_posts_sent++;
+		g_string_append_printf(request->request, "Content-Type: application/x-www-form-urlencoded\r\n"
+				"Content-Length: %" G_GSIZE_FORMAT "\r\n", form->len);
+	}
+	g_string_append(request->request, "\r\n");
+	if (form != NULL)
+		g_string_append_len(request->request, form->str, form->len);
+	g_free(hostname);
+	
+	g_queue_push_tail(&request->host->pending, request);
+	if (!request->host->dispatch_timer)
+		request->host->dispatch_timer = purple_timeout_add(0, translate_http_dispatch_cb, request->host);
+	
+	return request;
+}
+
+/** Fetches an http:// url over a pooled connection.  callback gets the response
+  * body, or NULL and an error_message */
+static TranslateHttpRequest *
+translate_http_get(const gchar *url, TranslateHttpCallback callback, gpointer userdata)
+{
+	return translate_http_request_new(url, NULL, NULL, callback, userdata);
+}
+
+/** Sends already-encoded form parameters to url: on the end of it when they're
+  * short, and as a POST body when they're long and the service takes POSTs, so
+  * that a long paste doesn't end up in an over-long url */
+static TranslateHttpRequest *
+translate_http_form(const gchar *url, const GString *params, gboolean can_post, TranslateHttpCallback callback, gpointer userdata)
+{
+	if (can_post && params->len > TRANSLATE_HTTP_POST_THRESHOLD)
+	{
+		purple_debug_info("translate", "Posting %" G_GSIZE_FORMAT " bytes to %s\n", params->len, url);
+		return translate_http_request_new(url, NULL, params, callback, userdata);
+	}
+	
+	purple_debug_info("translate", "Fetching %s?%s\n", url, params->str);
+	return translate_http_request_new(url, params->str, NULL, callback, userdata);
+}
+
+/** Drops a request without calling its callback.  If it was already on the wire
+  * its connection is closed, since the response can't be told apart from the next */
+static void
+translate_http_cancel(TranslateHttpRequest *request)
+{
+	TranslateHttpHost *host = request->host;
+	
+	if (request->connection != NULL)
+		translate_http_connection_close(request->connection);
+	else
+		g_queue_remove(&host->pending, request);
+	
+	translate_http_request_free(request);
+	translate_http_dispatch(host);
+}
+
+/** Closes every connection and drops every request, for when the plugin unloads */
+static void
+translate_http_shutdown(void)
+{
+	GHashTableIter iter;
+	TranslateHttpHost *host;
+	TranslateHttpRequest *request;
+	TranslateHttpConnection *conn;
+	GList *l;
+	
+	if (translate_http_scratch != NULL)
+	{
+		g_string_free(translate_http_scratch, TRUE);
+		translate_http_scratch = NULL;
+	}
+	
+	if (translate_http_hosts == NULL)
+		return;
+	
+	g_hash_table_iter_init(&iter, translate_http_hosts);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&host))
+	{
+		while ((request = g_queue_pop_head(&host->pending)))
+			translate_http_request_free(request);
+		while (host->connections != NULL)
+		{
+			conn = host->connections->data;
+			request = conn->request;
+			translate_http_connection_close(conn);
+			if (request != NULL)
+				translate_http_request_free(request);
+		}
+	}
+	
+	l = NULL;
+	g_hash_table_iter_init(&iter, translate_http_hosts);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&host))
+		l = g_list_prepend(l, host);
+	g_hash_table_destroy(translate_http_hosts);
+	translate_http_hosts = NULL;
+	
+	for(; l; l = g_list_delete_link(l, l))
+	{
+		host = l->data;
+		if (host->dispatch_timer)
+			purple_timeout_remove(host->dispatch_timer);
+		g_free(host->key);
+		g_free(host->hostname);
+		g_free(host);
+	}
+}
+
+struct _TranslateBatch;
+
+/** What a backend can do for us */
+typedef enum {
+	/* translate() works out the language itself when a lone phrase has no from language */
+	TRANSLATE_BACKEND_DETECTS_LANGUAGE = 1 << 0,
+} TranslateBackendFlags;
+
+/** A translation service.  translate() sends off every store in the batch and
+  * must finish each of them with translate_store_complete() then free the batch.
+  * detect(), if set, works out the language of a batch's lone phrase (setting
+  * from_lang and the store's detected_language) before handing it to translate().
+  * aliases, if set, lists the codes the service uses in place of ours (NULL terminated).
+  * hedge_with, if set, is the backend to also ask when this one is slow to answer.
+  * rate and burst size the service's token bucket; a rate of 0 means it's not limited.
+  * lookup, if set, answers a store without going to the network, filling in its
+  * translated_phrase (and detected_language) and returning TRUE; the phrases it
+  * can't answer go to the fallback_service pref's backend instead.
+  * request_len, if set, is how much of max_request_text a phrase takes up once it's
+  * encoded for the service; otherwise it's the phrase's URL-encoded length */
+typedef struct _TranslateBackend {
+	const gchar *id;
+	const gchar *name;
+	TranslateBackendFlags flags;
+	guint max_batch;
+	gsize max_request_text;
+	void (*translate)(struct _TranslateBatch *batch);
+	void (*detect)(struct _TranslateBatch *batch);
+	const TranslateLanguageAlias *aliases;
+	const gchar *hedge_with;
+	gdouble rate; //requests a second
+	gdouble burst;
+	gboolean (*lookup)(struct _TranslateStore *store, const gchar *from_lang, const gchar *to_lang);
+	gsize (*request_len)(const gchar *phrase);
+	
+	gdouble tokens;
+	gint64 refilled; //ms, when tokens was last topped up
+	
+	guint failures; //requests in a row that failed
+	gint64 open_until; //ms; the circuit breaker is open while this is set, and fails phrases straight away until then
+	guint cooldown; //ms the breaker will stay open for the next time it trips
+	gboolean probing; //the breaker has let one request through to see if the service is back
+} TranslateBackend;
+
+/** How much of the backend's max_request_text phrase takes up */
+static gsize
+translate_backend_request_len(TranslateBackend *backend, const gchar *phrase)
+{
+	if (backend->request_len != NULL)
+		return backend->request_len(phrase);
+	
+	return translate_http_encoded_len(phrase);
+}
+
+/** Our code for a language as the backend knows it */
+static const gchar *
+translate_language_for_backend(TranslateBackend *backend, const gchar *code)
+{
+	const TranslateLanguageAlias *alias;
+	
+	if (code == NULL || backend->aliases == NULL)
+		return code;
+	
+	for(alias = backend->aliases; alias->alias; alias++)
+		if (g_str_equal(alias->code, code))
+			return alias->alias;
+	
+	return code;
+}
+
+/** Stores for the same backend and language pair, waiting to go out as one request */
+struct _TranslateBatch {
+	gchar *key;
+	TranslateBackend *backend;
+	const gchar *from_lang; //interned, as the backend spells them
+	const gchar *to_lang;
+	GList *stores;
+	guint count;
+	gsize size;
+	guint timer; //the batch window, then the backend's own use, then the retry backoff
+	TranslatePriority priority;
+	gconstpointer owner;
+	gint64 queued; //ms, when it was handed to the scheduler
+	gboolean dispatched; //counts against the in-flight cap until it's freed
+	TranslateHttpRequest *request; //the backend's request on the wire, if any
+	guint deadline; //gives up on the request after request_timeout
+	guint hedge_timer; //asks the backend's hedge_with after hedge_delay
+	struct _TranslateBatch *hedge; //the other half of a hedged pair, while both are running
+	gboolean is_hedge; //its stores are stand-ins for the stores of the batch it hedges
+	guint attempts; //times it's been retried
+	gboolean probe; //let through the backend's open circuit breaker
+};
+
+/** Whether the store's request has gone out, rather than waiting in a batch or the scheduler */
+static gboolean
+translate_store_dispatched(struct _TranslateStore *store)
+{
+	return store->batch != NULL && store->batch->dispatched;
+}
+
+/** The registered backends, in the order they're offered in the prefs */
+static GList *translate_backends = NULL;
+
+static GHashTable *translate_batches = NULL;
+static GList *translate_batches_dispatched = NULL; //sent and not yet freed, so they can be cancelled
+static guint translate_batches_sent = 0;
+static guint translate_batched_phrases = 0;
+
+static void translate_scheduler_done(void);
+
+static guint translate_hedges_sent = 0;
+static guint translate_hedges_won = 0;
+static guint translate_requests_timed_out = 0;
+
+static void translate_hedge_abandon(struct _TranslateBatch *batch);
+
+/** Stops whatever the backend still has going for the batch, without finishing its stores */
+static void
+translate_batch_cancel(struct _TranslateBatch *batch)
+{
+	if (batch->request != NULL)
+		translate_http_cancel(batch->request);
+	batch->request = NULL;
+	
+	if (batch->timer)
+		purple_timeout_remove(batch->timer);
+	batch->timer = 0;
+}
+
+/** Takes a batch back off the wire's books: it stops counting against the in-flight
+  * cap and its deadline and hedge are called off */
+static void
+translate_batch_undispatch(struct _TranslateBatch *batch)
+{
+	if (batch->dispatched)
+	{
+		translate_batches_dispatched = g_list_remove(translate_batches_dispatched, batch);
+		translate_scheduler_done();
+	}
+	batch->dispatched = FALSE;
+	
+	if (batch->deadline)
+		purple_timeout_remove(batch->deadline);
+	batch->deadline = 0;
+	if (batch->hedge_timer)
+		purple_timeout_remove(batch->hedge_timer);
+	batch->hedge_timer = 0;
+	
+	// Cancelled before it could say whether the service is back, so let another try
+	if (batch->probe)
+		batch->backend->probing = FALSE;
+	batch->probe = FALSE;
+}
+
+static void
+translate_batch_free(struct _TranslateBatch *batch)
+{
+	struct _TranslateBatch *hedge;
+	
+	translate_batch_undispatch(batch);
+	
+	// The original answered first, so its stand-in is no longer wanted
+	if (batch->hedge != NULL)
+	{
+		hedge = batch->hedge;
+		hedge->hedge = NULL;
+		batch->hedge = NULL;
+		if (!batch->is_hedge)
+			translate_hedge_abandon(hedge);
+	}
+	
+	g_list_free(batch->stores);
+	g_free(batch->key);
+	g_free(batch);
+}
+
+/** Completes every store in the batch with its original text, for when the
+  * request failed or the response didn't have an answer for them */
+static void
+translate_batch_fail(struct _TranslateBatch *batch, const gchar *error_message)
+{
+	struct _TranslateBatch *other;
+	GList *l;
+	
+	if (batch->hedge != NULL)
+	{
+		// The other half of the pair is still going, so leave the stores to it
+		other = batch->hedge;
+		other->hedge = NULL;
+		batch->hedge = NULL;
+		translate_hedge_abandon(batch);
+		return;
+	}
+	
+	for(l = batch->stores; l; l = l->next)
+		translate_store_fail(l->data, error_message ? error_message : "The translation service didn't answer");
+	
+	translate_batch_free(batch);
+}
+
+static guint translate_requests_unsendable = 0;
+static guint translate_requests_too_long = 0;
+
+static void translate_store_deliver(struct _TranslateStore *store);
+
+/** The backend couldn't make a request for the batch at all.  Its stores fail from
+  * the main loop, since this can happen before translate_phrase() has returned */
+static void
+translate_batch_unsendable(struct _TranslateBatch *batch, const gchar *error_message)
+{
+	struct _TranslateStore *store;
+	GList *l;
+	
+	translate_requests_unsendable++;
+	purple_debug_error("translate", "Couldn't make a request to %s\n", batch->backend->id);
+	
+	if (batch->hedge != NULL)
+	{
+		// The other half of the pair is still going, so leave the stores to it
+		translate_batch_fail(batch, error_message);
+		return;
+	}
+	
+	for(l = batch->stores; l; l = l->next)
+	{
+		store = l->data;
+		store->batch = NULL;
+		store->no_store = TRUE;
+		store->translated_phrase = store->original_phrase;
+		store->error_message = error_message;
+		translate_store_deliver(store);
+	}
+	
+	translate_batch_free(batch);
+}
+
+static void translate_batch_retry(struct _TranslateBatch *batch, const gchar *error_message);
+static void translate_backend_succeeded(TranslateBackend *backend);
+
+/** A pull tokenizer for the services' JSON responses.  String values are decoded
+  * straight onto the end of one output buffer as they're reached, and either kept
+  * there (so every result in a response shares the one allocation) or dropped */
+typedef enum {
+	TRANSLATE_JSON_END = 0,
+	TRANSLATE_JSON_OBJECT_START,
+	TRANSLATE_JSON_OBJECT_END,
+	TRANSLATE_JSON_ARRAY_START,
+	TRANSLATE_JSON_ARRAY_END,
+	TRANSLATE_JSON_KEY,
+	TRANSLATE_JSON_STRING,
+	TRANSLATE_JSON_LITERAL
+} TranslateJsonToken;
+
+typedef struct {
+	const gchar *pos;
+	const gchar *end;
+	guint depth;
+	GString *output;
+	gsize string_start;
+} TranslateJsonParser;
+
+static void
+translate_json_parser_init(TranslateJsonParser *parser, const gchar *json, gsize len, GString *output)
+{
+	parser->pos = json;
+	parser->end = json + len;
+	parser->depth = 0;
+	parser->output = output;
+	parser->string_start = output->len;
+	
+	// Microsoft's responses start with a byte order mark
+	if (len >= 3 && memcmp(json, "\xEF\xBB\xBF", 3) == 0)
+		parser->pos += 3;
+}
+
+static TranslateJsonToken
+translate_json_next(TranslateJsonParser *parser)
+{
+	const gchar *pos = parser->pos;
+	const gchar *end = parser->end;
+	TranslateJsonToken token;
+	
+	while (pos < end && (g_ascii_isspace(*pos) || *pos == ',' || *pos == ':'))
+		pos++;
+	
+	if (pos >= end)
+	{
+		parser->pos = end;
+		return TRANSLATE_JSON_END;
+	}
+	
+	switch(*pos)
+	{
+		case '{':
+			parser->depth++;
+			token = TRANSLATE_JSON_OBJECT_START;
+			pos++;
+			break;
+		case '[':
+			parser->depth++;
+			token = TRANSLATE_JSON_ARRAY_START;
+			pos++;
+			break;
+		case '}':
+		case ']':
+			if (parser->depth > 0)
+				parser->depth--;
+			token = (*pos == '}') ? TRANSLATE_JSON_OBJECT_END : TRANSLATE_JSON_ARRAY_END;
+			pos++;
+			break;
+		case '"':
+			parser->string_start = parser->output->len;
+			pos = translate_unescape(parser->output, pos + 1, end, TRUE);
+			if (pos == NULL)
+			{
+				g_string_truncate(parser->output, parser->string_start);
+				parser->pos = end;
+				return TRANSLATE_JSON_END;
+			}
+			while (pos < end && g_ascii_isspace(*pos))
+				pos++;
+			token = (pos < end && *pos == ':') ? TRANSLATE_JSON_KEY : TRANSLATE_JSON_STRING;
+			break;
+		default:
+			while (pos < end && !g_ascii_isspace(*pos) && *pos != ',' && *pos != '}' && *pos != ']')
+				pos++;
+			token = TRANSLATE_JSON_LITERAL;
+			break;
+	}
+	
+	parser->pos = pos;
+	return token;
+}
+
+static gboolean
+translate_json_string_is(TranslateJsonParser *parser, const gchar *name)
+{
+	return g_str_equal(parser->output->str + parser->string_start, name);
+}
+
+/** Keeps the string just read in the output, returning its offset */
+static gssize
+translate_json_string_keep(TranslateJsonParser *parser)
+{
+	g_string_append_c(parser->output, '\0');
+	return parser->string_start;
+}
+
+/** Drops the key/string just read from the output */
+static void
+translate_json_string_drop(TranslateJsonParser *parser)
+{
+	g_string_truncate(parser->output, parser->string_start);
+}
+
+/** Where each phrase's translation and language ended up in the output buffer, or -1 */
+struct _TranslateJsonResult {
+	gssize translated;
+	gssize language;
+};
+
+/** Finishes each store in the batch from the parsed results; anything the
+  * response didn't answer gets its original text back */
+static void
+translate_batch_complete_results(struct _TranslateBatch *batch, GString *output, struct _TranslateJsonResult *results)
+{
+	struct _TranslateStore *store;
+	const gchar *language;
+	GList *l;
+	guint i;
+	
+	translate_backend_succeeded(batch->backend);
+	
+	for(l = batch->stores, i = 0; l; l = l->next, i++)
+	{
+		store = l->data;
+		language = (results[i].language >= 0) ? output->str + results[i].language : store->detected_language;
+		
+		if (results[i].translated < 0)
+		{
+			translate_store_fail(store, "The translation service didn't return a translation");
+		} else {
+			translate_store_complete(store, output->str + results[i].translated, language);
+		}
+	}
+	
+	translate_batch_free(batch);
+}
+
+static struct _TranslateJsonResult *
+translate_json_results_new(guint count)
+{
+	struct _TranslateJsonResult *results;
+	guint i;
+	
+	results = g_new(struct _TranslateJsonResult, count);
+	for(i = 0; i < count; i++)
+		results[i].translated = results[i].language = -1;
+	
+	return results;
+}
+
+/** Reads a response that is just a JSON string, like Microsoft's Translate and Detect */
+static gchar *
+translate_json_parse_string(const gchar *json, gsize len)
+{
+	TranslateJsonParser parser;
+	GString *output;
+	
+	if (json == NULL)
+		return NULL;
+	
+	output = g_string_sized_new(len);
+	translate_json_parser_init(&parser, json, len, output);
+	
+	if (translate_json_next(&parser) != TRANSLATE_JSON_STRING)
+	{
+		g_string_free(output, TRUE);
+		return NULL;
+	}
+	
+	return g_string_free(output, FALSE);
+}
+
+/** Appends text as a quoted JSON string */
+static void
+translate_json_append_string(GString *json, const gchar *text)
+{
+	g_string_append_c(json, '"');
+	for(; *text; text++)
+	{
+		if (*text == '"' || *text == '\\')
+		{
+			g_string_append_c(json, '\\');
+			g_string_append_c(json, *text);
+		} else if ((guchar) *text < 0x20) {
+			g_string_append_printf(json, "\\u%04x", (guchar) *text);
+		} else {
+			g_string_append_c(json, *text);
+		}
+	}
+	g_string_append_c(json, '"');
+}
+
+void
+google_translate_cb(TranslateHttpRequest *request, gpointer user_data, const gchar *url_text, gsize len, const gchar *error_message)
+{
+	struct _TranslateBatch *batch = user_data;
+	TranslateJsonParser parser;
+	TranslateJsonToken token;
+	struct _TranslateJsonResult *results;
+	GString *output;
+	gboolean multiple = FALSE;
+	gint slot = 0;
+	gssize *target = NULL;
+
+	batch->request = NULL;
+	
+	if (!url_text || !len)
+	{
+		translate_batch_retry(batch, error_message);
+		return;
+	}
+	
+	purple_debug_info("translate", "Got response: %s\n", url_text);
+	
+	// A single q= gives {"responseData": {"translatedText":..,"detectedSourceLanguage":..},..}
+	// while several give {"responseData": [{"responseData": {..},..}, ..],..} in q= order
+	results = translate_json_results_new(batch->count);
+	output = g_string_sized_new(len);
+	translate_json_parser_init(&parser, url_text, len, output);
+	
+	while ((token = translate_json_next(&parser)) != TRANSLATE_JSON_END)
+	{
+		switch(token)
+		{
+			case TRANSLATE_JSON_ARRAY_START:
+				if (parser.depth == 2)
+				{
+					multiple = TRUE;
+					slot = -1;
+				}
+				break;
+			case TRANSLATE_JSON_OBJECT_START:
+				if (multiple && parser.depth == 3)
+					slot++;
+				break;
+			case TRANSLATE_JSON_KEY:
+				target = NULL;
+				if (slot >= 0 && slot < (gint) batch->count)
+				{
+					if (translate_json_string_is(&parser, "translatedText"))
+						target = &results[slot].translated;
+					else if (translate_json_string_is(&parser, "detectedSourceLanguage"))
+						target = &results[slot].language;
+				}
+				translate_json_string_drop(&parser);
+				break;
+			case TRANSLATE_JSON_STRING:
+				if (target != NULL)
+					*target = translate_json_string_keep(&parser);
+				else
+					translate_json_string_drop(&parser);
+				target = NULL;
+				break;
+			default:
+				target = NULL;
+				break;
+		}
+	}
+	
+	translate_batch_complete_results(batch, output, results);
+	
+	g_string_free(output, TRUE);
+	g_free(results);
+}
+
+static void
+google_translate(struct _TranslateBatch *batch)
+{
+	GString *params;
+	struct _TranslateStore *store;
+	GList *l;
+	
+	params = translate_http_params();
+	g_string_append_printf(params, "v=1.0&langpair=%s%%7C%s", batch->from_lang, batch->to_lang);
+	for(l = batch->stores; l; l = l->next)
+	{
+		store = l->data;
+		g_string_append(params, "&q=");
+		translate_http_append_encoded(params, store->original_phrase);
+	}
+	
+	batch->request = translate_http_form("http://ajax.googleapis.com/ajax/services/language/translate",
+							params, TRUE, google_translate_cb, batch);
+	if (batch->request == NULL)
+		translate_batch_unsendable(batch, "Couldn't make the request");
+}
+
+static TranslateBackend google_backend = {
+	.id = "google",
+	.name = "Google Translate",
+	.flags = TRANSLATE_BACKEND_DETECTS_LANGUAGE,
+	.max_batch = 10,
+	.max_request_text = 5000, //long batches get POSTed
+	.translate = google_translate,
+	.hedge_with = "bing",
+	.rate = 5.0,
+	.burst = 10.0
+};
+
+void
+bing_translate_cb(TranslateHttpRequest *request, gpointer user_data, const gchar *url_text, gsize len, const gchar *error_message)
+{
+	struct _TranslateBatch *batch = user_data;
+	struct _TranslateStore *store = batch->stores->data;
+	gchar *translated;
+
+	batch->request = NULL;
+	
+	if (!url_text || !len)
+	{
+		translate_batch_retry(batch, error_message);
+		return;
+	}
+	
+	purple_debug_info("translate", "Got response: %s\n", url_text);
+	
+	translated = translate_json_parse_string(url_text, len);
+	if (translated == NULL)
+	{
+		translate_batch_fail(batch, "The translation service's answer didn't make sense");
+		return;
+	}
+	
+	translate_backend_succeeded(batch->backend);
+	translate_store_complete(store, translated, store->detected_language);
+	
+	g_free(translated);
+	translate_batch_free(batch);
+}
+
+void
+bing_translate_array_cb(TranslateHttpRequest *request, gpointer user_data, const gchar *url_text, gsize len, const gchar *error_message)
+{
+	struct _TranslateBatch *batch = user_data;
+	TranslateJsonParser parser;
+	TranslateJsonToken token;
+	struct _TranslateJsonResult *results;
+	GString *output;
+	gint slot = -1;
+	gssize *target = NULL;
+	
+	batch->request = NULL;
+	
+	if (!url_text || !len)
+	{
+		translate_batch_retry(batch, error_message);
+		return;
+	}
+	
+	purple_debug_info("translate", "Got response: %s\n", url_text);
+	
+	// An array of {"From":"..",...,"TranslatedText":".."} in the order the texts were sent
+	results = translate_json_results_new(batch->count);
+	output = g_string_sized_new(len);
+	translate_json_parser_init(&parser, url_text, len, output);
+	
+	while ((token = translate_json_next(&parser)) != TRANSLATE_JSON_END)
+	{
+		switch(token)
+		{
+			case TRANSLATE_JSON_OBJECT_START:
+				if (parser.depth == 2)
+					slot++;
+				break;
+			case TRANSLATE_JSON_KEY:
+				target = NULL;
+				if (slot >= 0 && slot < (gint) batch->count && parser.depth == 2)
+				{
+					if (translate_json_string_is(&parser, "TranslatedText"))
+						target = &results[slot].translated;
+					else if (!(*batch->from_lang) && translate_json_string_is(&parser, "From"))
+						target = &results[slot].language;
+				}
+				translate_json_string_drop(&parser);
+				break;
+			case TRANSLATE_JSON_STRING:
+				if (target != NULL)
+					*target = translate_json_string_keep(&parser);
+				else
+					translate_json_string_drop(&parser);
+				target = NULL;
+				break;
+			default:
+				target = NULL;
+				break;
+		}
+	}
+	
+	translate_batch_complete_results(batch, output, results);
+	
+	g_string_free(output, TRUE);
+	g_free(results);
+}
+
+/** Appends text to params as a URL-encoded JSON string, the way the Bing Ajax API
+  * takes its texts, escaping and encoding it in the one pass */
+static void
+bing_append_text(GString *params, const gchar *text)
+{
+	gchar c[2] = {0, 0};
+	
+	g_string_append(params, "%22");
+	for(; *text; text++)
+	{
+		c[0] = *text;
+		if (*text == '"' || *text == '\\')
+		{
+			g_string_append(params, "%5C");
+			translate_http_append_encoded(params, c);
+		} else if ((guchar) *text < 0x20) {
+			g_string_append_printf(params, "%%5Cu%04x", (guchar) *text);
+		} else {
+			translate_http_append_encoded(params, c);
+		}
+	}
+	g_string_append(params, "%22");
+}
+
+/** How long a phrase is once bing_append_text() has escaped and encoded it */
+static gsize
+bing_request_len(const gchar *phrase)
+{
+	gsize len = 6; //the quotes
+	gchar c[2] = {0, 0};
+	
+	for(; *phrase; phrase++)
+	{
+		c[0] = *phrase;
+		if (*phrase == '"' || *phrase == '\\')
+			len += 6;
+		else if ((guchar) *phrase < 0x20)
+			len += 8;
+		else
+			len += translate_http_encoded_len(c);
+	}
+	
+	return len;
+}
+
+static void
+bing_translate(struct _TranslateBatch *batch)
+{
+	GString *params;
+	GString *texts;
+	struct _TranslateStore *store;
+	GList *l;
+	
+	// The Ajax API only takes GETs, so Bing's texts always go in the url
+	params = translate_http_params();
+	g_string_append(params, "appId=" BING_APPID);
+	
+	if (batch->count > 1 || !(*batch->from_lang))
+	{
+		// TranslateArray takes a JSON array of texts and detects the language of each if there's no from
+		texts = g_string_new("[");
+		for(l = batch->stores; l; l = l->next)
+		{
+			store = l->data;
+			if (l != batch->stores)
+				g_string_append_c(texts, ',');
+			translate_json_append_string(texts, store->original_phrase);
+		}
+		g_string_append_c(texts, ']');
+		
+		g_string_append(params, "&texts=");
+		translate_http_append_encoded(params, texts->str);
+		g_string_append_printf(params, "&from=%s&to=%s", batch->from_lang, batch->to_lang);
+		
+		batch->request = translate_http_form("http://api.microsofttranslator.com/V2/Ajax.svc/TranslateArray",
+								params, FALSE, bing_translate_array_cb, batch);
+		if (batch->request == NULL)
+			translate_batch_unsendable(batch, "Couldn't make the request");
+		
+		g_string_free(texts, TRUE);
+		return;
+	}
+	
+	store = batch->stores->data;
+	g_string_append(params, "&text=");
+	bing_append_text(params, store->original_phrase);
+	g_string_append_printf(params, "&from=%s&to=%s", batch->from_lang, batch->to_lang);
+	
+	batch->request = translate_http_form("http://api.microsofttranslator.com/V2/Ajax.svc/Translate",
+							params, FALSE, bing_translate_cb, batch);
+	if (batch->request == NULL)
+		translate_batch_unsendable(batch, "Couldn't make the request");
+}
+
+void
+bing_detect_cb(TranslateHttpRequest *request, gpointer user_data, const gchar *url_text, gsize len, const gchar *error_message)
+{
+	struct _TranslateBatch *batch = user_data;
+	struct _TranslateStore *store = batch->stores->data;
+	gchar *from_lang;
+	
+	batch->request = NULL;
+	
+	if (!url_text || !len)
+	{
+		translate_batch_retry(batch, error_message);
+		return;
+	}
+	
+	purple_debug_info("translate", "Got response: %s\n", url_text);
+	
+	from_lang = translate_json_parse_string(url_text, len);
+	if (!from_lang || !(*from_lang))
+	{
+		// Unknown language, not worth caching
+		g_free(from_lang);
+		translate_batch_fail(batch, error_message ? error_message : "Couldn't work out which language it's in");
+		return;
+	}
+	
+	batch->from_lang = g_intern_string(from_lang);
+	store->detected_language = translate_language_canonical(from_lang);
+	g_free(from_lang);
+	
+	bing_translate(batch);
+}
+
+static void
+bing_detect(struct _TranslateBatch *batch)
+{
+	struct _TranslateStore *store = batch->stores->data;
+	GString *params;
+	
+	params = translate_http_params();
+	g_string_append(params, "appId=" BING_APPID "&text=");
+	bing_append_text(params, store->original_phrase);
+	
+	batch->request = translate_http_form("http://api.microsofttranslator.com/V2/Ajax.svc/Detect",
+							params, FALSE, bing_detect_cb, batch);
+	if (batch->request == NULL)
+		translate_batch_unsendable(batch, "Couldn't make the request");
+}
+
+static const TranslateLanguageAlias bing_languages[] = {
+	{"he", "iw"},
+	{"zh-CHS", "zh-CN"},
+	{"zh-CHT", "zh-TW"},
+	{NULL, NULL}
+};
+
+static TranslateBackend bing_backend = {
+	.id = "bing",
+	.name = "Microsoft Translator",
+	.max_batch = 10,
+	.max_request_text = 1800,
+	.translate = bing_translate,
+	.detect = bing_detect,
+	.aliases = bing_languages,
+	.hedge_with = "google",
+	.rate = 5.0,
+	.burst = 10.0,
+	.request_len = bing_request_len
+};
+
+/** A stand-in backend that never touches the network, so the rest of the plugin
+  * can be exercised with a known latency and failure rate.  "Translates" by
+  * tagging the phrase with the target language */
+static gboolean
+mock_translate_cb(gpointer userdata)
+{
+	struct _TranslateBatch *batch = userdata;
+	struct _TranslateStore *store;
+	gchar *translated;
+	const gchar *lang;
+	gint error_rate;
+	GList *l;
+	
+	batch->timer = 0;
+	
+	error_rate = translate_config.mock_error_rate;
+	if (g_random_int_range(0, 100) < error_rate)
+	{
+		purple_debug_info("translate", "Mock backend failing a batch of %u\n", batch->count);
+		translate_batch_retry(batch, "The test backend failed on purpose");
+		return FALSE;
+	}
+	
+	for(l = batch->stores; l; l = l->next)
+	{
+		store = l->data;
+		lang = *batch->from_lang ? NULL : translate_detect_language(store->original_phrase);
+		translated = g_strdup_printf("[%s] %s", batch->to_lang, store->original_phrase);
+		
+		translate_store_complete(store, translated, lang);
+		
+		g_free(translated);
+	}
+	
+	translate_backend_succeeded(batch->backend);
+	translate_batch_free(batch);
+	
+	return FALSE;
+}
+
+static void
+mock_translate(struct _TranslateBatch *batch)
+{
+	gint latency;
+	
+	latency = translate_config.mock_latency;
+	
+	// Up to 50% jitter either way
+	if (latency > 1)
+		latency += g_random_int_range(-latency / 2, latency / 2 + 1);
+	
+	// The batch window is over by now, so its timer can be reused
+	batch->timer = purple_timeout_add(MAX(latency, 0), mock_translate_cb, batch);
+}
+
+static TranslateBackend mock_backend = {
+	.id = "mock",
+	.name = "Test backend (offline, for debugging)",
+	.flags = TRANSLATE_BACKEND_DETECTS_LANGUAGE,
+	.max_batch = 50,
+	.max_request_text = G_MAXINT,
+	.translate = mock_translate
+};
+
+/** The offline phrase table, built by purple-translate-phrasetable (see
+  * purple-translate-phrases.h for the format).  It's opened on the first lookup
+  * and binary searched straight out of the mapping */
+static gchar *translate_phrases_filename = NULL;
+static gboolean translate_phrases_opened = FALSE;
+static GMappedFile *translate_phrases_map = NULL;
+static guint32 translate_phrases_count = 0;
+static guint translate_phrases_hits = 0;
+static guint translate_phrases_misses = 0;
+
+static void
+translate_phrases_close(void)
+{
+	if (translate_phrases_map != NULL)
+		g_mapped_file_unref(translate_phrases_map);
+	translate_phrases_map = NULL;
+	translate_phrases_count = 0;
+	translate_phrases_opened = FALSE;
+}
+
+static gboolean
+translate_phrases_open(void)
+{
+	const gchar *data;
+	gsize length;
+	
+	if (translate_phrases_opened)
+		return translate_phrases_map != NULL;
+	translate_phrases_opened = TRUE;
+	
+	if (translate_phrases_filename == NULL)
+		return FALSE;
+	
+	translate_phrases_map = g_mapped_file_new(translate_phrases_filename, FALSE, NULL);
+	if (translate_phrases_map == NULL)
+	{
+		purple_debug_info("translate", "No phrase table at %s\n", translate_phrases_filename);
+		return FALSE;
+	}
+	
+	data = g_mapped_file_get_contents(translate_phrases_map);
+	length = g_mapped_file_get_length(translate_phrases_map);
+	translate_phrases_count = translate_phrases_count_records(data, length);
+	if (translate_phrases_count == 0)
+	{
+		purple_debug_warning("translate", "Ignoring unrecognised phrase table %s\n", translate_phrases_filename);
+		g_mapped_file_unref(translate_phrases_map);
+		translate_phrases_map = NULL;
+		translate_phrases_count = 0;
+		return FALSE;
+	}
+	
+	purple_debug_info("translate", "Opened phrase table %s with %u phrases\n", translate_phrases_filename, translate_phrases_count);
+	
+	return TRUE;
+}
+
+/** The translation of key ("from\tto\tphrase") in the phrase table, or NULL */
+static const gchar *
+translate_phrases_find(const gchar *key)
+{
+	return translate_phrases_search(g_mapped_file_get_contents(translate_phrases_map),
+					g_mapped_file_get_length(translate_phrases_map), translate_phrases_count, key);
+}
+
+/** Puts back the capital letter and punctuation a normalized match lost, so that
+  * "Thanks!" comes back as "Merci!" rather than "merci" */
+static gchar *
+translate_phrases_restyle(const gchar *phrase, const gchar *translation)
+{
+	GString *styled;
+	const gchar *trailing, *prev;
+	gunichar first;
+	
+	styled = g_string_sized_new(strlen(translation) + 8);
+	first = g_utf8_get_char(translation);
+	if (g_unichar_isupper(g_utf8_get_char(phrase)) && g_unichar_islower(first))
+	{
+		g_string_append_unichar(styled, g_unichar_toupper(first));
+		g_string_append(styled, g_utf8_next_char(translation));
+	} else {
+		g_string_append(styled, translation);
+	}
+	
+	for(trailing = phrase + strlen(phrase); trailing > phrase; trailing = prev)
+	{
+		prev = g_utf8_find_prev_char(phrase, trailing);
+		if (g_unichar_isspace(g_utf8_get_char(prev)) || !translate_phrases_is_trailing(g_utf8_get_char(prev)))
+			break;
+	}
+	prev = g_utf8_find_prev_char(styled->str, styled->str + styled->len);
+	if (*trailing && prev != NULL && !translate_phrases_is_trailing(g_utf8_get_char(prev)))
+		g_string_append(styled, trailing);
+	
+	return g_string_free(styled, FALSE);
+}
+
+static gboolean
+offline_lookup(struct _TranslateStore *store, const gchar *from_lang, const gchar *to_lang)
+{
+	const gchar *translation;
+	gchar *key, *normal, *restyled;
+	
+	if (!translate_phrases_open())
+		return FALSE;
+	
+	if (!*from_lang)
+	{
+		// The table is by language pair, so we have to know what it's in
+		from_lang = translate_detect_language(store->original_phrase);
+		if (from_lang == NULL)
+		{
+			translate_phrases_misses++;
+			return FALSE;
+		}
+		store->detected_language = translate_language_canonical(from_lang);
+	}
+	
+	key = translate_phrases_make_key(from_lang, to_lang, store->original_phrase);
+	translation = translate_phrases_find(key);
+	g_free(key);
+	
+	if (translation != NULL)
+	{
+		store->translated_phrase = translate_arena_strdup(&store->arena, translation);
+	} else {
+		normal = translate_phrases_normalize(store->original_phrase);
+		key = translate_phrases_make_key(from_lang, to_lang, normal);
+		translation = translate_phrases_find(key);
+		g_free(key);
+		g_free(normal);
+		
+		if (translation != NULL)
+		{
+			restyled = translate_phrases_restyle(store->original_phrase, translation);
+			store->translated_phrase = translate_arena_strdup(&store->arena, restyled);
+			g_free(restyled);
+		}
+	}
+	
+	if (translation == NULL)
+	{
+		store->detected_language = NULL;
+		translate_phrases_misses++;
+		return FALSE;
+	}
+	
+	translate_phrases_hits++;
+	return TRUE;
+}
+
+static void
+offline_translate(struct _TranslateBatch *batch)
+{
+	// translate_phrase() answers misses itself when there's no fallback_service, so
+	// nothing should get here; if it does, the stores mustn't fail before it returns
+	translate_batch_unsendable(batch, "Not in the phrase table, and there's no service to fall back to");
+}
+
+static TranslateBackend offline_backend = {
+	.id = "offline",
+	.name = "Phrase table (offline, asks the fallback service otherwise)",
+	.max_batch = 50,
+	.max_request_text = G_MAXINT,
+	.translate = offline_translate,
+	.lookup = offline_lookup
+};
+
+static void
+translate_backend_register(TranslateBackend *backend)
+{
+	translate_backends = g_list_append(translate_backends, backend);
+}
+
+static void
+translate_backend_unregister(TranslateBackend *backend)
+{
+	translate_backends = g_list_remove(translate_backends, backend);
+}
+
+static TranslateBackend *
+translate_backend_find(const gchar *id)
+{
+	GList *l;
+	TranslateBackend *backend;
+	
+	if (id == NULL)
+		return NULL;
+	
+	for(l = translate_backends; l; l = l->next)
+	{
+		backend = l->data;
+		if (g_str_equal(backend->id, id))
+			return backend;
+	}
+	
+	return NULL;
+}
+
+static gboolean translate_batch_hedge_cb(gpointer userdata);
+static gboolean translate_batch_deadline_cb(gpointer userdata);
+
+static void
+translate_batch_send(struct _TranslateBatch *batch)
+{
+	TranslateBackend *backend = batch->backend;
+	struct _TranslateStore *store = batch->stores->data;
+	const gchar *from_lang;
+	
+	translate_batches_sent++;
+	translate_batched_phrases += batch->count;
+	
+	// Set up before the backend gets it, in case it finishes straight away
+	batch->deadline = purple_timeout_add(translate_config.request_timeout, translate_batch_deadline_cb, batch);
+	if (!batch->is_hedge && translate_config.hedge_delay > 0 && backend->hedge_with != NULL)
+		batch->hedge_timer = purple_timeout_add(translate_config.hedge_delay, translate_batch_hedge_cb, batch);
+	
+	if (!(*batch->from_lang) && batch->count == 1 && backend->detect && !(backend->flags & TRANSLATE_BACKEND_DETECTS_LANGUAGE))
+	{
+		// Skip the detect request if we can tell the language ourselves
+		from_lang = translate_detect_language(store->original_phrase);
+		if (from_lang == NULL)
+		{
+			backend->detect(batch);
+			return;
+		}
+		
+		batch->from_lang = g_intern_string(translate_language_for_backend(backend, from_lang));
+		store->detected_language = translate_language_canonical(from_lang);
+	}
+	
+	backend->translate(batch);
+}
+
+/** Milliseconds on a clock that only goes forwards, for the scheduler */
+static gint64
+translate_now_ms(void)
+{
+#if GLIB_CHECK_VERSION(2, 28, 0)
+	return g_get_monotonic_time() / 1000;
+#else
+	GTimeVal now;
+	
+	g_get_current_time(&now);
+	return (gint64) now.tv_sec * 1000 + now.tv_usec / 1000;
+#endif
+}
+
+/** A conversation's batches waiting in one priority class */
+typedef struct {
+	gconstpointer owner;
+	GQueue batches;
+} TranslateSchedulerFlow;
+
+/** Flows with batches waiting, per priority class, served round-robin so that one
+  * busy conversation can't starve the others in its class */
+static GQueue translate_scheduler_flows[TRANSLATE_PRIORITY_COUNT];
+static guint translate_scheduler_timer = 0;
+static guint translate_scheduler_inflight = 0;
+static guint translate_scheduler_depth[TRANSLATE_PRIORITY_COUNT];
+static guint translate_scheduler_max_depth[TRANSLATE_PRIORITY_COUNT];
+static guint translate_scheduler_dispatched[TRANSLATE_PRIORITY_COUNT];
+static guint64 translate_scheduler_wait_ms[TRANSLATE_PRIORITY_COUNT];
+static guint translate_scheduler_throttled = 0;
+
+static void translate_scheduler_dispatch(void);
+static void translate_batch_hold(struct _TranslateBatch *batch, guint delay);
+
+/** Takes a token from the backend's bucket, or says how long until there'll be one */
+static gboolean
+translate_backend_take_token(TranslateBackend *backend, gint64 now, gint64 *wait_ms)
+{
+	if (backend->rate <= 0)
+		return TRUE;
+	
+	if (backend->refilled == 0)
+		backend->tokens = backend->burst;
+	else
+		backend->tokens = MIN(backend->burst, backend->tokens + (now - backend->refilled) * backend->rate / 1000.0);
+	backend->refilled = now;
+	
+	if (backend->tokens >= 1.0)
+	{
+		backend->tokens -= 1.0;
+		return TRUE;
+	}
+	
+	*wait_ms = (gint64) ((1.0 - backend->tokens) * 1000.0 / backend->rate) + 1;
+	return FALSE;
+}
+
+/** Failures in a row that trip a backend's circuit breaker */
+#define TRANSLATE_BREAKER_FAILURES 5
+
+/** How long (ms) a tripped breaker stays open, doubling each time a probe fails */
+#define TRANSLATE_BREAKER_COOLDOWN 15000
+#define TRANSLATE_BREAKER_COOLDOWN_MAX (5 * 60 * 1000)
+
+static guint translate_breaker_trips = 0;
+static guint translate_breaker_rejected = 0;
+
+/** Whether the backend can be sent a request: its breaker is closed, or it's been
+  * open long enough that the next request can go and see if the service is back */
+static gboolean
+translate_backend_available(TranslateBackend *backend, gint64 now)
+{
+	if (!backend->open_until)
+		return TRUE;
+	
+	return now >= backend->open_until && !backend->probing;
+}
+
+/** Like translate_backend_available(), but lets the batch through as the probe if
+  * the breaker is open, so that nothing else goes until it's answered */
+static gboolean
+translate_backend_allow(TranslateBackend *backend, struct _TranslateBatch *batch, gint64 now)
+{
+	if (!translate_backend_available(backend, now))
+		return FALSE;
+	
+	if (backend->open_until)
+	{
+		purple_debug_info("translate", "Seeing if %s is back\n", backend->id);
+		backend->probing = TRUE;
+		batch->probe = TRUE;
+	}
+	
+	return TRUE;
+}
+
+static void
+translate_backend_succeeded(TranslateBackend *backend)
+{
+	if (backend->open_until)
+		purple_debug_info("translate", "%s is answering again\n", backend->id);
+	
+	backend->failures = 0;
+	backend->open_until = 0;
+	backend->cooldown = 0;
+	backend->probing = FALSE;
+}
+
+/** Counts a failed request against the backend, opening its breaker once enough have
+  * failed in a row, or straight away again if it was the probe that failed */
+static void
+translate_backend_failed(TranslateBackend *backend)
+{
+	guint cooldown;
+	
+	backend->failures++;
+	if (backend->failures < TRANSLATE_BREAKER_FAILURES && !backend->probing)
+		return;
+	
+	// Requests that went out before it tripped don't keep it open for longer
+	if (backend->open_until && !backend->probing)
+		return;
+	
+	if (backend->cooldown == 0)
+		backend->cooldown = TRANSLATE_BREAKER_COOLDOWN;
+	
+	// A little jitter so that clients that went down together don't all come back together
+	cooldown = backend->cooldown / 2 + g_random_int_range(0, backend->cooldown / 2 + 1);
+	backend->open_until = translate_now_ms() + cooldown;
+	backend->cooldown = MIN(backend->cooldown * 2, TRANSLATE_BREAKER_COOLDOWN_MAX);
+	backend->probing = FALSE;
+	
+	translate_breaker_trips++;
+	purple_debug_info("translate", "%s has failed %u times in a row, not using it for %ums\n", backend->id, backend->failures, cooldown);
+}
+
+/** The next batch allowed out: the most urgent class first, taking turns between
+  * conversations within a class, skipping any whose service is out of tokens */
+static struct _TranslateBatch *
+translate_scheduler_next(gint64 now, gint64 *wait_ms)
+{
+	TranslateSchedulerFlow *flow;
+	struct _TranslateBatch *batch;
+	guint priority, i, flows;
+	
+	for(priority = 0; priority < TRANSLATE_PRIORITY_COUNT; priority++)
+	{
+		// Drafts never take the last free slot, so a message that's sent isn't stuck behind one
+		if (priority == TRANSLATE_PRIORITY_SPECULATIVE && translate_scheduler_inflight + 1 >= translate_config.max_in_flight)
+			break;
+		
+		flows = g_queue_get_length(&translate_scheduler_flows[priority]);
+		for(i = 0; i < flows; i++)
+		{
+			flow = g_queue_pop_head(&translate_scheduler_flows[priority]);
+			batch = g_queue_peek_head(&flow->batches);
+			
+			if (!translate_backend_take_token(batch->backend, now, wait_ms))
+			{
+				g_queue_push_tail(&translate_scheduler_flows[priority], flow);
+				continue;
+			}
+			
+			g_queue_pop_head(&flow->batches);
+			if (g_queue_is_empty(&flow->batches))
+				g_free(flow);
+			else
+				g_queue_push_tail(&translate_scheduler_flows[priority], flow);
+			
+			translate_scheduler_depth[priority]--;
+			return batch;
+		}
+	}
+	
+	return NULL;
+}
+
+static gboolean
+translate_scheduler_timeout_cb(gpointer userdata)
+{
+	translate_scheduler_timer = 0;
+	translate_scheduler_dispatch();
+	
+	return FALSE;
+}
+
+/** Sends as many queued batches as the in-flight cap and rate limits allow */
+static void
+translate_scheduler_dispatch(void)
+{
+	struct _TranslateBatch *batch;
+	gint64 now = translate_now_ms();
+	gint64 wait_ms = G_MAXINT;
+	guint priority;
+	gboolean queued = FALSE;
+	
+	while (translate_scheduler_inflight < translate_config.max_in_flight)
+	{
+		batch = translate_scheduler_next(now, &wait_ms);
+		if (batch == NULL)
+			break;
+		
+		if (!translate_backend_allow(batch->backend, batch, now))
+		{
+			// Its service went down while it waited, so it fails from the main loop
+			translate_batch_hold(batch, 0);
+			continue;
+		}
+		
+		translate_scheduler_inflight++;
+		translate_scheduler_dispatched[batch->priority]++;
+		translate_scheduler_wait_ms[batch->priority] += now - batch->queued;
+		batch->dispatched = TRUE;
+		translate_batches_dispatched = g_list_prepend(translate_batches_dispatched, batch);
+		translate_batch_send(batch);
+	}
+	
+	for(priority = 0; priority < TRANSLATE_PRIORITY_COUNT; priority++)
+		if (translate_scheduler_depth[priority])
+			queued = TRUE;
+	
+	// Still room in flight but everything's rate limited, so wake up when a token's due
+	if (queued && wait_ms < G_MAXINT && translate_scheduler_inflight < translate_config.max_in_flight && !translate_scheduler_timer)
+	{
+		translate_scheduler_throttled++;
+		translate_scheduler_timer = purple_timeout_add((guint) MIN(wait_ms, G_MAXINT), translate_scheduler_timeout_cb, NULL);
+	}
+}
+
+/** Queues a batch that's ready to go behind anything more urgent */
+static void
+translate_scheduler_enqueue(struct _TranslateBatch *batch)
+{
+	GQueue *flows = &translate_scheduler_flows[batch->priority];
+	TranslateSchedulerFlow *flow = NULL;
+	GList *l;
+	
+	for(l = flows->head; l; l = l->next)
+	{
+		if (((TranslateSchedulerFlow *) l->data)->owner == batch->owner)
+		{
+			flow = l->data;
+			break;
+		}
+	}
+	if (flow == NULL)
+	{
+		flow = g_new0(TranslateSchedulerFlow, 1);
+		flow->owner = batch->owner;
+		g_queue_push_tail(flows, flow);
+	}
+	
+	g_queue_push_tail(&flow->batches, batch);
+	batch->queued = translate_now_ms();
+	
+	translate_scheduler_depth[batch->priority]++;
+	translate_scheduler_max_depth[batch->priority] = MAX(translate_scheduler_max_depth[batch->priority], translate_scheduler_depth[batch->priority]);
+	
+	translate_scheduler_dispatch();
+}
+
+/** A dispatched batch has finished, so another can go; dispatching happens from the
+  * main loop rather than inside whichever backend callback is freeing the batch */
+static void
+translate_scheduler_done(void)
+{
+	translate_scheduler_inflight--;
+	
+	if (translate_scheduler_timer)
+		purple_timeout_remove(translate_scheduler_timer);
+	translate_scheduler_timer = purple_timeout_add(0, translate_scheduler_timeout_cb, NULL);
+}
+
+/** Forgets everything still queued, for when the plugin is unloaded */
+static void
+translate_scheduler_shutdown(void)
+{
+	TranslateSchedulerFlow *flow;
+	struct _TranslateBatch *batch;
+	GList *l;
+	guint priority;
+	
+	if (translate_scheduler_timer)
+		purple_timeout_remove(translate_scheduler_timer);
+	translate_scheduler_timer = 0;
+	
+	for(priority = 0; priority < TRANSLATE_PRIORITY_COUNT; priority++)
+	{
+		while ((flow = g_queue_pop_head(&translate_scheduler_flows[priority])))
+		{
+			while ((batch = g_queue_pop_head(&flow->batches)))
+			{
+				for(l = batch->stores; l; l = l->next)
+					translate_store_free(l->data);
+				translate_batch_free(batch);
+			}
+			g_free(flow);
+		}
+		translate_scheduler_depth[priority] = 0;
+	}
+}
+
+/** Drops one half of a hedged pair that lost (or failed while the other half is
+  * still going).  A hedge's stand-in stores go with it; an original's stores are
+  * left for the hedge to finish */
+static void
+translate_hedge_abandon(struct _TranslateBatch *batch)
+{
+	struct _TranslateStore *store;
+	GList *l;
+	
+	translate_batch_cancel(batch);
+	
+	for(l = batch->stores; l; l = l->next)
+	{
+		store = l->data;
+		if (batch->is_hedge)
+			translate_store_free(store);
+		else
+			store->batch = NULL;
+	}
+	
+	translate_batch_free(batch);
+}
+
+/** The TranslateCallback for a hedge's stand-in stores; userdata is the original store */
+static void
+translate_hedge_store_cb(const gchar *original_phrase, const gchar *translated_phrase, const gchar *detected_language, const gchar *error_message, gpointer userdata)
+{
+	struct _TranslateStore *store = userdata;
+	struct _TranslateBatch *original = store->batch;
+	
+	if (original != NULL && original->hedge == NULL)
+	{
+		// The hedge was dropped when another of its phrases failed, so this one is
+		// still the original's to answer
+		return;
+	}
+	
+	if (original != NULL && error_message != NULL)
+	{
+		// A hedge that couldn't answer is no reason to give up on the original, so
+		// drop the hedge and keep waiting
+		purple_debug_info("translate", "%s couldn't answer in place of %s, still waiting on %s\n",
+		                  original->hedge->backend->id, original->backend->id, original->backend->id);
+		original->hedge->hedge = NULL;
+		original->hedge = NULL;
+		return;
+	}
+	
+	if (original != NULL)
+	{
+		// The hedge answered first, so stop waiting on the original
+		translate_hedges_won++;
+		original->hedge->hedge = NULL;
+		original->hedge = NULL;
+		translate_hedge_abandon(original);
+	}
+	
+	translate_store_finish(store, translated_phrase, detected_language, error_message);
+}
+
+/** The batch's backend is taking its time, so ask the one it hedges with as well.
+  * Whichever answers first is used and the other is cancelled */
+static gboolean
+translate_batch_hedge_cb(gpointer userdata)
+{
+	struct _TranslateBatch *batch = userdata;
+	struct _TranslateBatch *hedge;
+	struct _TranslateStore *store, *stand_in;
+	TranslateBackend *backend;
+	const gchar *from_lang, *to_lang;
+	gint64 wait_ms;
+	GList *l;
+	
+	batch->hedge_timer = 0;
+	
+	backend = translate_backend_find(batch->backend->hedge_with);
+	if (backend == NULL || translate_scheduler_inflight >= translate_config.max_in_flight ||
+		!translate_backend_available(backend, translate_now_ms()) ||
+		!translate_backend_take_token(backend, translate_now_ms(), &wait_ms))
+	{
+		// Hedging is only worth it when it's free
+		return FALSE;
+	}
+	
+	from_lang = translate_language_canonical(batch->from_lang);
+	to_lang = translate_language_canonical(batch->to_lang);
+	
+	hedge = g_new0(struct _TranslateBatch, 1);
+	hedge->key = g_strdup_printf("%s|hedge", batch->key);
+	hedge->backend = backend;
+	hedge->from_lang = g_intern_string(translate_language_for_backend(backend, from_lang));
+	hedge->to_lang = g_intern_string(translate_language_for_backend(backend, to_lang));
+	hedge->priority = batch->priority;
+	hedge->owner = batch->owner;
+	hedge->is_hedge = TRUE;
+	
+	for(l = batch->stores; l; l = l->next)
+	{
+		store = l->data;
+		stand_in = translate_store_new(backend->id, store->original_phrase, from_lang, to_lang, translate_hedge_store_cb, store);
+		stand_in->priority = store->priority;
+		stand_in->owner = store->owner;
+		stand_in->batch = hedge;
+		hedge->stores = g_list_prepend(hedge->stores, stand_in);
+		hedge->count++;
+	}
+	hedge->stores = g_list_reverse(hedge->stores);
+	hedge->size = batch->size;
+	
+	batch->hedge = hedge;
+	hedge->hedge = batch;
+	
+	purple_debug_info("translate", "%s is slow, also asking %s\n", batch->backend->id, backend->id);
+	translate_hedges_sent++;
+	translate_scheduler_inflight++;
+	hedge->dispatched = TRUE;
+	translate_batches_dispatched = g_list_prepend(translate_batches_dispatched, hedge);
+	translate_batch_send(hedge);
+	
+	return FALSE;
+}
+
+/** A request has taken longer than request_timeout, so give up on it */
+static gboolean
+translate_batch_deadline_cb(gpointer userdata)
+{
+	struct _TranslateBatch *batch = userdata;
+	
+	batch->deadline = 0;
+	translate_requests_timed_out++;
+	purple_debug_info("translate", "Request to %s timed out\n", batch->backend->id);
+	
+	translate_batch_cancel(batch);
+	translate_batch_retry(batch, "The translation service took too long to answer");
+	
+	return FALSE;
+}
+
+/** Most batches waiting to be retried at once; past this a failure is final */
+#define TRANSLATE_RETRY_MAX_QUEUED 32
+#define TRANSLATE_RETRY_MAX_ATTEMPTS 3
+
+/** The backoff (ms) before the first retry, doubling for each one after */
+#define TRANSLATE_RETRY_DELAY 1000
+#define TRANSLATE_RETRY_DELAY_MAX 30000
+
+/** Batches waiting out their backoff before going back to the scheduler */
+static GQueue translate_retries = G_QUEUE_INIT;
+static guint translate_retries_sent = 0;
+static guint translate_retries_exhausted = 0;
+static guint translate_retries_unwanted = 0;
+
+static gboolean translate_store_wanted(struct _TranslateStore *store);
+
+/** Whether anything is still waiting on a batch's answer, so that it's worth trying again */
+static gboolean
+translate_batch_wanted(struct _TranslateBatch *batch)
+{
+	GList *l;
+	
+	for(l = batch->stores; l; l = l->next)
+		if (translate_store_wanted(l->data))
+			return TRUE;
+	
+	return FALSE;
+}
+
+static gboolean
+translate_batch_retry_cb(gpointer userdata)
+{
+	struct _TranslateBatch *batch = userdata;
+	
+	batch->timer = 0;
+	g_queue_remove(&translate_retries, batch);
+	
+	if (!translate_backend_available(batch->backend, translate_now_ms()))
+	{
+		translate_batch_fail(batch, "The translation service isn't answering at the moment");
+		return FALSE;
+	}
+	if (!translate_batch_wanted(batch))
+	{
+		// Its messages went out untranslated while it waited
+		translate_retries_unwanted++;
+		translate_batch_fail(batch, "It took too long to translate");
+		return FALSE;
+	}
+	
+	translate_scheduler_enqueue(batch);
+	
+	return FALSE;
+}
+
+/** Sets a batch aside for delay ms, then gives it back to the scheduler if its
+  * backend is still worth asking, or fails it if not */
+static void
+translate_batch_hold(struct _TranslateBatch *batch, guint delay)
+{
+	g_queue_push_tail(&translate_retries, batch);
+	batch->timer = purple_timeout_add(delay, translate_batch_retry_cb, batch);
+}
+
+/** A request failed without an answer (the connection dropped, the service errored
+  * or timed out).  The batch is tried again after a jittered, exponential backoff,
+  * unless it's used up its retries, the retry queue is full or the backend's breaker
+  * has opened, in which case its phrases go out untranslated */
+static void
+translate_batch_retry(struct _TranslateBatch *batch, const gchar *error_message)
+{
+	guint delay;
+	
+	translate_backend_failed(batch->backend);
+	
+	// Drafts aren't worth more load on a struggling service, and a hedged pair
+	// already has its second chance
+	if (batch->hedge != NULL || batch->is_hedge || batch->priority == TRANSLATE_PRIORITY_SPECULATIVE ||
+		batch->attempts >= TRANSLATE_RETRY_MAX_ATTEMPTS || g_queue_get_length(&translate_retries) >= TRANSLATE_RETRY_MAX_QUEUED ||
+		!translate_backend_available(batch->backend, translate_now_ms()))
+	{
+		if (batch->attempts > 0)
+			translate_retries_exhausted++;
+		translate_batch_fail(batch, error_message);
+		return;
+	}
+	if (!translate_batch_wanted(batch))
+	{
+		// Nobody's waiting on the answer any more, so don't load the service for it
+		translate_retries_unwanted++;
+		translate_batch_fail(batch, error_message);
+		return;
+	}
+	
+	translate_batch_cancel(batch);
+	translate_batch_undispatch(batch);
+	
+	delay = MIN(TRANSLATE_RETRY_DELAY << batch->attempts, TRANSLATE_RETRY_DELAY_MAX);
+	delay = delay / 2 + g_random_int_range(0, delay / 2 + 1);
+	batch->attempts++;
+	translate_retries_sent++;
+	
+	purple_debug_info("translate", "Request to %s failed (%s), trying again in %ums\n",
+	                  batch->backend->id, error_message ? error_message : "no answer", delay);
+	translate_batch_hold(batch, delay);
+}
+
+static void
+translate_batch_flush(struct _TranslateBatch *batch)
+{
+	if (batch->timer)
+		purple_timeout_remove(batch->timer);
+	batch->timer = 0;
+	
+	g_hash_table_steal(translate_batches, batch->key);
+	
+	translate_scheduler_enqueue(batch);
+}
+
+static gboolean
+translate_batch_timeout_cb(gpointer userdata)
+{
+	struct _TranslateBatch *batch = userdata;
+	
+	batch->timer = 0;
+	translate_batch_flush(batch);
+	
+	return FALSE;
+}
+
+/** Queues a store to go out with any others for the same backend and languages.
+  * The batch is sent when the batch window closes or it can't hold any more */
+static void
+translate_batch_add(TranslateBackend *backend, struct _TranslateStore *store, const gchar *from_lang, const gchar *to_lang)
+{
+	struct _TranslateBatch *batch;
+	gchar *key;
+	gsize size;
+	gconstpointer owner;
+	gint window, max_count;
+	
+	window = translate_config.batch_window;
+	max_count = MIN(translate_config.batch_size, backend->max_batch);
+	size = translate_backend_request_len(backend, store->original_phrase);
+	from_lang = translate_language_for_backend(backend, from_lang);
+	to_lang = translate_language_for_backend(backend, to_lang);
+	
+	if (size > backend->max_request_text)
+	{
+		// Even on its own it would make a request the service won't take
+		translate_requests_too_long++;
+		store->no_store = TRUE;
+		store->translated_phrase = store->original_phrase;
+		store->error_message = "The message is too long for the translation service";
+		translate_store_deliver(store);
+		return;
+	}
+	
+	if (translate_batches == NULL)
+		translate_batches = g_hash_table_new(g_str_hash, g_str_equal);
+	
+	// Chats are batched per room so that a busy one can't hold up the others
+	owner = store->priority == TRANSLATE_PRIORITY_CHAT ? store->owner : NULL;
+	key = g_strdup_printf("%s|%s|%s|%d|%p", backend->id, from_lang, to_lang, store->priority, owner);
+	batch = g_hash_table_lookup(translate_batches, key);
+	
+	if (batch != NULL && batch->size + size > backend->max_request_text)
+	{
+		translate_batch_flush(batch);
+		batch = NULL;
+	}
+	
+	if (batch == NULL)
+	{
+		batch = g_new0(struct _TranslateBatch, 1);
+		batch->key = key;
+		batch->backend = backend;
+		batch->from_lang = g_intern_string(from_lang);
+		batch->to_lang = g_intern_string(to_lang);
+		batch->priority = store->priority;
+		batch->owner = owner;
+		g_hash_table_insert(translate_batches, batch->key, batch);
+	} else {
+		g_free(key);
+	}
+	
+	batch->stores = g_list_append(batch->stores, store);
+	store->batch = batch;
+	batch->count++;
+	batch->size += size;
+	
+	if (window <= 0 || batch->count >= (guint) MAX(max_count, 1))
+		translate_batch_flush(batch);
+	else if (!batch->timer)
+		batch->timer = purple_timeout_add(window, translate_batch_timeout_cb, batch);
+}
+
+static guint translate_stores_cancelled = 0;
+
+/** Whether a store, and everyone waiting on it, belongs to owner (or anyone, if NULL) */
+static gboolean
+translate_store_owned_by(struct _TranslateStore *store, gconstpointer owner)
+{
+	GSList *l;
+	
+	if (owner == NULL)
+		return TRUE;
+	if (store->owner != owner)
+		return FALSE;
+	
+	for(l = store->waiters; l; l = l->next)
+		if (((struct _TranslateStore *) l->data)->owner != owner)
+			return FALSE;
+	
+	return TRUE;
+}
+
+/** Fails the stores in a batch that hasn't been sent yet that belong to owner,
+  * returning TRUE if that leaves it empty */
+static gboolean
+translate_batch_cancel_owner(struct _TranslateBatch *batch, gconstpointer owner, const gchar *reason)
+{
+	struct _TranslateStore *store;
+	GList *l, *next;
+	
+	for(l = batch->stores; l; l = next)
+	{
+		next = l->next;
+		store = l->data;
+		if (!translate_store_owned_by(store, owner))
+			continue;
+		
+		batch->stores = g_list_delete_link(batch->stores, l);
+		batch->count--;
+		batch->size -= MIN(batch->size, translate_backend_request_len(batch->backend, store->original_phrase));
+		store->batch = NULL;
+		translate_stores_cancelled++;
+		translate_store_fail(store, reason);
+	}
+	
+	return batch->stores == NULL;
+}
+
+/** Stops translating everything for owner (usually a conversation), or everything at
+  * all if it's NULL.  Batches still waiting lose its phrases, and a request on the
+  * wire for nothing but its phrases is cancelled.  Each phrase is failed with reason,
+  * so whatever was waiting on it is finished and freed as usual */
+static void
+translate_cancel(gconstpointer owner, const gchar *reason)
+{
+	GHashTableIter iter;
+	struct _TranslateBatch *batch;
+	TranslateSchedulerFlow *flow;
+	GList *l, *next, *link;
+	guint priority;
+	
+	if (translate_batches != NULL)
+	{
+		g_hash_table_iter_init(&iter, translate_batches);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&batch))
+		{
+			if (!translate_batch_cancel_owner(batch, owner, reason))
+				continue;
+			
+			g_hash_table_iter_steal(&iter);
+			translate_batch_cancel(batch);
+			translate_batch_free(batch);
+		}
+	}
+	
+	for(l = translate_retries.head; l; l = next)
+	{
+		next = l->next;
+		batch = l->data;
+		if (!translate_batch_cancel_owner(batch, owner, reason))
+			continue;
+		
+		g_queue_delete_link(&translate_retries, l);
+		translate_batch_cancel(batch);
+		translate_batch_free(batch);
+	}
+	
+	for(priority = 0; priority < TRANSLATE_PRIORITY_COUNT; priority++)
+	{
+		for(l = translate_scheduler_flows[priority].head; l; l = next)
+		{
+			next = l->next;
+			flow = l->data;
+			link = flow->batches.head;
+			while (link != NULL)
+			{
+				batch = link->data;
+				link = link->next;
+				if (!translate_batch_cancel_owner(batch, owner, reason))
+					continue;
+				
+				g_queue_remove(&flow->batches, batch);
+				translate_batch_free(batch);
+				translate_scheduler_depth[priority]--;
+			}
+			
+			if (g_queue_is_empty(&flow->batches))
+			{
+				g_queue_delete_link(&translate_scheduler_flows[priority], l);
+				g_free(flow);
+			}
+		}
+	}
+	
+	// A request can't be taken back in part, as the answers come back in order
+	do {
+		batch = NULL;
+		for(l = translate_batches_dispatched; l; l = l->next)
+		{
+			batch = l->data;
+			for(link = batch->stores; link; link = link->next)
+				if (!translate_store_owned_by(link->data, owner))
+					break;
+			if (link == NULL)
+				break;
+			batch = NULL;
+		}
+		
+		if (batch != NULL)
+		{
+			// A hedged pair's stores are only counted once, when the second half goes
+			if (batch->hedge == NULL)
+				translate_stores_cancelled += batch->count;
+			translate_batch_cancel(batch);
+			translate_batch_fail(batch, reason);
+		}
+	} while (batch != NULL);
+}
+
+/** Translates plain_phrase with the given backend, answering from the cache, an
+  * identical request already on the wire, or a (possibly batched) new request.
+  * callback is always called from the main loop, never before this returns */
+static void
+translate_phrase(TranslateBackend *backend, const gchar *plain_phrase, const gchar *from_lang, const gchar *to_lang, TranslatePriority priority, gconstpointer owner, TranslateCallback callback, gpointer userdata)
+{
+	struct _TranslateStore *store;
+	
+	if (!from_lang || g_str_equal(from_lang, "auto"))
+		from_lang = "";
+	
+	store = translate_store_new(backend->id, plain_phrase, from_lang, to_lang, callback, userdata);
+	store->priority = priority;
+	store->owner = owner;
+	if (translate_cache_lookup(store))
+		return;
+	if (backend->lookup != NULL)
+	{
+		if (backend->lookup(store, from_lang, to_lang))
+		{
+			// Answered locally, so there's nothing worth caching either
+			store->no_store = TRUE;
+			translate_store_deliver(store);
+			return;
+		}
+		if (translate_config.fallback == NULL)
+		{
+			// Nothing to ask instead, so show the original without making a batch
+			store->no_store = TRUE;
+			store->translated_phrase = store->original_phrase;
+			store->error_message = "Not in the phrase table, and there's no service to fall back to";
+			translate_store_deliver(store);
+			return;
+		}
+		backend = translate_config.fallback;
+	}
+	if (translate_inflight_join(store))
+		return;
+	
+	if (!translate_backend_available(backend, translate_now_ms()))
+	{
+		// The service is down, so show the original rather than pile on
+		translate_breaker_rejected++;
+		store->no_store = TRUE;
+		store->translated_phrase = store->original_phrase;
+		store->error_message = "The translation service isn't answering at the moment";
+		translate_store_deliver(store);
+		return;
+	}
+	
+	translate_batch_add(backend, store, from_lang, to_lang);
+}
+
+static guint translate_fast_path_messages = 0;
+static guint translate_masked_spans = 0;
+
+/** Emoticons that have letters in them, so aren't caught by the no-letters rule */
+static const gchar *translate_emoticons[] = {
+	":D", ":-D", ":P", ":-P", ":p", ":-p", ";P", ";p", ";D", "xD", "XD", "xP",
+	":o", ":O", ":-o", ":-O", ":s", ":S", ":x", ":X", "D:", "o_O", "O_o", "o.O",
+	NULL
+};
+
+/** How many letters a whitespace-delimited word has if it reads as natural language,
+  * or 0 if it's a URL, email address, path, number, emoticon or bit of code */
+static guint
+translate_word_letters(const gchar *word, gsize len)
+{
+	const gchar *pos, *end = word + len;
+	const gchar *at = NULL, *entity;
+	guint letters = 0, i;
+	gunichar c;
+	
+	for(pos = word; pos < end; pos = g_utf8_next_char(pos))
+	{
+		c = g_utf8_get_char(pos);
+		if (c == '&' && (entity = memchr(pos, ';', MIN(end - pos, 10))))
+			pos = entity; //&amp; and friends aren't letters
+		else if (g_unichar_isalpha(c))
+			letters++;
+		else if (c == '@')
+			at = pos;
+		else if ((c == '_' || c == '=' || c == ';' || c == '{' || c == '}' || c == '\\' || c == '|') && pos + 1 < end)
+			return 0; //snake_case, a=b, foo;bar, but not the end of a clause;
+		else if (c == ':' && pos + 2 < end && pos[1] == '/' && pos[2] == '/')
+			return 0;
+		else if (c == '.' && pos - word >= 2 && end - pos > 2 && g_ascii_isalnum(pos[-1]) && g_ascii_isalnum(pos[1]) && g_ascii_isalnum(pos[2]))
+			return 0; //domain.com, file.txt, object.method
+		else if ((c == '(' && pos + 1 < end && pos[1] == ')') || (c == '-' && pos + 1 < end && pos[1] == '>'))
+			return 0;
+	}
+	
+	if (letters == 0)
+		return 0;
+	if (at != NULL && at > word)
+		return 0; //someone@example
+	if (word[0] == '/' || word[0] == '~' || (len > 2 && word[1] == ':' && word[2] == '/'))
+		return 0;
+	if (len > 4 && g_ascii_strncasecmp(word, "www.", 4) == 0)
+		return 0;
+	
+	if (len <= 3)
+		for(i = 0; translate_emoticons[i]; i++)
+			if (strlen(translate_emoticons[i]) == len && strncmp(translate_emoticons[i], word, len) == 0)
+				return 0;
+	
+	return letters;
+}
+
+static void
+translate_spans_append(GArray *spans, gsize start, gsize len, gboolean translate)
+{
+	TranslateSpan *last;
+	TranslateSpan span;
+	
+	if (spans->len)
+	{
+		last = &g_array_index(spans, TranslateSpan, spans->len - 1);
+		if (last->translate == translate)
+		{
+			last->len = start + len - last->start;
+			return;
+		}
+	}
+	
+	span.start = start;
+	span.len = len;
+	span.translate = translate;
+	g_array_append_val(spans, span);
+}
+
+static guint translate_split_messages = 0;
+
+/** Splits a message's markup in one pass into sentences worth translating and runs
+  * to keep as they are: tags, `code spans`, URLs and the like, and the whitespace
+  * around them.  Returns NULL if there's nothing worth sending to a translator at all */
+static GArray *
+translate_markup_split(const gchar *text)
+{
+	GArray *spans, *sentences;
+	TranslateSpan *span;
+	guint i;
+	const gchar *pos = text, *word, *space, *close;
+	gsize space_len;
+	guint letters = 0, word_letters, masked = 0;
+	gboolean is_text, previous_text = FALSE;
+	
+	spans = g_array_new(FALSE, FALSE, sizeof(TranslateSpan));
+	
+	while (*pos)
+	{
+		space = pos;
+		while (g_ascii_isspace(*pos))
+			pos++;
+		space_len = pos - space;
+		if (!*pos)
+		{
+			translate_spans_append(spans, space - text, space_len, FALSE);
+			break;
+		}
+		
+		word = pos;
+		if (*pos == '<')
+		{
+			// Tags stay exactly where they are; the text either side of them goes on its own
+			close = strchr(pos, '>');
+			pos = close ? close + 1 : pos + strlen(pos);
+			if (space_len)
+				translate_spans_append(spans, space - text, space_len, FALSE);
+			translate_spans_append(spans, word - text, pos - word, FALSE);
+			previous_text = FALSE;
+			continue;
+		}
+		if (*pos == '`' && (close = strchr(pos + 1, '`')) && !memchr(pos, '<', close - pos))
+		{
+			pos = close + 1;
+			word_letters = 0;
+		} else {
+			while (*pos && *pos != '<' && !g_ascii_isspace(*pos))
+				pos++;
+			word_letters = translate_word_letters(word, pos - word);
+		}
+		is_text = word_letters > 0;
+		
+		// Whitespace only goes along with the translation when it's between two words of it
+		if (space_len)
+			translate_spans_append(spans, space - text, space_len, is_text && previous_text);
+		translate_spans_append(spans, word - text, pos - word, is_text);
+		letters += word_letters;
+		if (!is_text)
+			masked++;
+		previous_text = is_text;
+	}
+	
+	// Single letters ("k", "?") aren't worth a request either
+	if (letters < 2)
+	{
+		g_array_free(spans, TRUE);
+		return NULL;
+	}
+	
+	translate_masked_spans += masked;
+	
+	sentences = g_array_sized_new(FALSE, FALSE, sizeof(TranslateSpan), spans->len);
+	for(i = 0; i < spans->len; i++)
+	{
+		span = &g_array_index(spans, TranslateSpan, i);
+		if (span->translate)
+			translate_spans_add_sentences(sentences, text, span);
+		else
+			g_array_append_val(sentences, *span);
+	}
+	g_array_free(spans, TRUE);
+	
+	if (sentences->len > 1)
+		translate_split_messages++;
+	
+	return sentences;
+}
+
+/** Appends translated text to a message's markup, escaping anything that would be
+  * taken for markup, without needing a copy of its own */
+static void
+translate_markup_append_text(GString *markup, const gchar *text)
+{
+	const gchar *pos;
+	
+	for(pos = text; *pos; pos++)
+	{
+		switch(*pos)
+		{
+			case '&': g_string_append(markup, "&amp;"); break;
+			case '<': g_string_append(markup, "&lt;"); break;
+			case '>': g_string_append(markup, "&gt;"); break;
+			case '"': g_string_append(markup, "&quot;"); break;
+			case '\n': g_string_append(markup, "<br>"); break;
+			default: g_string_append_c(markup, *pos); break;
+		}
+	}
+}
+
+/** A message that went out as several phrases, put back together as they come in */
+struct _TranslateMultipart;
+
+typedef struct {
+	struct _TranslateMultipart *multipart;
+	gchar *translated_phrase;
+} TranslateMultipartSlot;
+
+struct _TranslateMultipart {
+	gchar *text;
+	GArray *spans;
+	TranslateMultipartSlot *slots; //one per span, only used for the translated ones
+	guint remaining;
+	const gchar *detected_language;
+	gchar *error_message;
+	TranslateCallback callback;
+	gpointer userdata;
+};
+
+static void
+translate_multipart_part_cb(const gchar *original_phrase, const gchar *translated_phrase, const gchar *detected_language, const gchar *error_message, gpointer userdata)
+{
+	TranslateMultipartSlot *slot = userdata;
+	struct _TranslateMultipart *multipart = slot->multipart;
+	TranslateSpan *span;
+	GString *joined;
+	guint i;
+	
+	slot->translated_phrase = g_strdup(translated_phrase);
+	if (detected_language && !multipart->detected_language)
+		multipart->detected_language = detected_language;
+	if (error_message && !multipart->error_message)
+		multipart->error_message = g_strdup(error_message);
+	
+	if (--multipart->remaining)
+		return;
+	
+	// Translations come out a little longer than they went in, more often than not
+	joined = g_string_sized_new(strlen(multipart->text) * 5 / 4 + 16);
+	for(i = 0; i < multipart->spans->len; i++)
+	{
+		span = &g_array_index(multipart->spans, TranslateSpan, i);
+		if (span->translate)
+			translate_markup_append_text(joined, multipart->slots[i].translated_phrase);
+		else
+			g_string_append_len(joined, multipart->text + span->start, span->len);
+	}
+	
+	multipart->callback(multipart->text, joined->str, multipart->detected_language, multipart->error_message, multipart->userdata);
+	
+	for(i = 0; i < multipart->spans->len; i++)
+		g_free(multipart->slots[i].translated_phrase);
+	g_string_free(joined, TRUE);
+	g_free(multipart->slots);
+	g_array_free(multipart->spans, TRUE);
+	g_free(multipart->error_message);
+	g_free(multipart->text);
+	g_free(multipart);
+}
+
+/** Translates a message's markup split up by translate_markup_split(), sending only
+  * the text runs that need it and splicing their translations back in between the
+  * original tags.  Each sentence is looked up in the cache on its own, and the ones
+  * that miss go out together in as few batches as will hold them.  Takes ownership
+  * of spans; if it's NULL the callback gets the markup back unchanged straight away */
+static void
+translate_markup(TranslateBackend *backend, const gchar *text, GArray *spans, const gchar *from_lang, const gchar *to_lang, TranslatePriority priority, gconstpointer owner, TranslateCallback callback, gpointer userdata)
+{
+	struct _TranslateMultipart *multipart;
+	TranslateSpan *span;
+	gchar *markup, *phrase;
+	guint i;
+	
+	if (spans == NULL)
+	{
+		translate_fast_path_messages++;
+		callback(text, text, NULL, NULL, userdata);
+		return;
+	}
+	
+	multipart = g_new0(struct _TranslateMultipart, 1);
+	multipart->text = g_strdup(text);
+	multipart->spans = spans;
+	multipart->slots = g_new0(TranslateMultipartSlot, spans->len);
+	multipart->callback = callback;
+	multipart->userdata = userdata;
+	
+	for(i = 0; i < spans->len; i++)
+		if (g_array_index(spans, TranslateSpan, i).translate)
+			multipart->remaining++;
+	
+	for(i = 0; i < spans->len; i++)
+	{
+		span = &g_array_index(spans, TranslateSpan, i);
+		if (!span->translate)
+			continue;
+		
+		multipart->slots[i].multipart = multipart;
+		markup = g_strndup(text + span->start, span->len);
+		phrase = purple_unescape_html(markup);
+		translate_phrase(backend, phrase, from_lang, to_lang, priority, owner, translate_multipart_part_cb, &multipart->slots[i]);
+		g_free(phrase);
+		g_free(markup);
+	}
+}
+
+/** The whole translation of a message's markup if every sentence of it is already in
+  * the cache, otherwise NULL.  Unlike translate_markup() it answers straight away, and
+  * spans are left to the caller */
+static gchar *
+translate_markup_lookup(TranslateBackend *backend, const gchar *text, GArray *spans, const gchar *from_lang, const gchar *to_lang)
+{
+	struct _TranslateCacheEntry *entry;
+	TranslateArena arena = { NULL, 0, 0, NULL };
+	TranslateSpan *span;
+	GString *joined;
+	gchar *markup, *phrase, *key;
+	guint i;
+	
+	if (translate_cache == NULL)
+		return NULL;
+	if (!from_lang || g_str_equal(from_lang, "auto"))
+		from_lang = "";
+	
+	translate_arena_reserve(&arena, 256);
+	joined = g_string_sized_new(strlen(text) * 5 / 4 + 16);
+	for(i = 0; i < spans->len; i++)
+	{
+		span = &g_array_index(spans, TranslateSpan, i);
+		if (!span->translate)
+		{
+			g_string_append_len(joined, text + span->start, span->len);
+			continue;
+		}
+		
+		markup = g_strndup(text + span->start, span->len);
+		phrase = purple_unescape_html(markup);
+		key = translate_cache_make_key(&arena, backend->id, from_lang, to_lang, phrase);
+		entry = g_hash_table_lookup(translate_cache, key);
+		g_free(phrase);
+		g_free(markup);
+		translate_arena_reset(&arena);
+		
+		if (entry == NULL)
+		{
+			g_string_free(joined, TRUE);
+			translate_arena_free(&arena);
+			return NULL;
+		}
+		translate_markup_append_text(joined, entry->translated_phrase);
+	}
+	
+	translate_arena_free(&arena);
+	
+	return g_string_free(joined, FALSE);
+}
+
+struct TranslateConvMessage;
+typedef void (*TranslateConvRelease)(struct TranslateConvMessage *convmsg, const gchar *original_phrase, const gchar *translated_phrase, const gchar *detected_language, const gchar *error_message);
+
+struct TranslateConvMessage {
+	PurpleAccount *account;
+	gchar *sender;
+	PurpleConversation *conv; //NULL once the conversation has gone away
+	PurpleMessageFlags flags;
+	TranslateConvRelease release; //writes or sends the message once it's its turn
+	guint seq; //position in the conversation, for debugging
+	time_t when; //when it arrived
+	gchar *original_phrase;
+	gchar *translated_phrase; //set once translated, while it waits for the ones before it
+	const gchar *detected_language; //interned
+	gchar *error_message; //why it couldn't be translated
+	gboolean translated;
+	gboolean released; //gave up waiting and went out untranslated
+	gboolean outbox; //an outgoing message in translate_outbox, until it's sent
+	gboolean detached; //an outgoing message taken out of the order, sent as soon as it's translated
+	TranslateArena arena; //owns the sender and the phrases
+	struct TranslateConvMessage *next_free; //while it's in translate_conv_message_pool
+};
+
+/** Messages that have been finished with, kept to save going back to malloc */
+static struct TranslateConvMessage *translate_conv_message_pool = NULL;
+static guint translate_conv_message_pool_size = 0;
+
+/** What we know about translating a conversation, kept on the conversation itself
+  * so that a busy room doesn't go through the buddy list for every line */
+typedef struct {
+	PurpleBlistNode *node; //the buddy or chat, NULL if it's not on the buddy list
+	gchar *stored_lang; //its eionrobb-translate-lang setting, NULL if unset
+	const TranslateLanguage *language; //stored_lang resolved, NULL for auto, none or unknown
+	TranslateBackend *backend;
+	guint generation; //translate_conv_generation when the above was worked out
+	GList *pending; //TranslateConvMessages waiting on a translation
+	GQueue ordered; //TranslateConvMessages not yet released, in the order they arrived
+	guint next_seq;
+	guint reorder_timer; //releases the head of ordered if it holds everything up for too long
+	gchar *draft; //what's being typed, while speculate is on
+	guint draft_timer; //translates the draft once it's stopped changing
+	GHashTable *senders; //TranslateChatSenders by name, for chats in auto
+	GQueue senders_lru; //most recently heard from at the head
+} TranslateConvState;
+
+static PurpleBlistNode *
+translate_conv_find_node(PurpleAccount *account, const gchar *name, PurpleConversationType type)
+{
+	if (type == PURPLE_CONV_TYPE_IM)
+		return (PurpleBlistNode *) purple_find_buddy(account, name);
+	else if (type == PURPLE_CONV_TYPE_CHAT)
+		return (PurpleBlistNode *) purple_blist_find_chat(account, name);
+	
+	return NULL;
+}
+
+/** The conversation's translation state, worked out again if the buddy list,
+  * the prefs or its language have changed since it was last used */
+static TranslateConvState *
+translate_conv_state(PurpleConversation *conv)
+{
+	TranslateConvState *state;
+	
+	state = purple_conversation_get_data(conv, "eionrobb-translate-state");
+	if (state == NULL)
+	{
+		state = g_new0(TranslateConvState, 1);
+		purple_conversation_set_data(conv, "eionrobb-translate-state", state);
+	}
+	
+	if (state->generation != translate_conv_generation)
+	{
+		state->node = translate_conv_find_node(conv->account, conv->name, conv->type);
+		g_free(state->stored_lang);
+		state->stored_lang = NULL;
+		if (state->node != NULL)
+			state->stored_lang = g_strdup(purple_blist_node_get_string(state->node, "eionrobb-translate-lang"));
+		state->language = translate_language_find(state->stored_lang);
+		state->backend = translate_config.backend;
+		state->generation = translate_conv_generation;
+	}
+	
+	return state;
+}
+
+/** Whether nothing in the conversation is waiting on a translation, so a message
+  * can skip the queue without overtaking anything */
+static gboolean
+translate_conv_idle(PurpleConversation *conv)
+{
+	TranslateConvState *state;
+	
+	if (conv == NULL)
+		return TRUE;
+	
+	state = purple_conversation_get_data(conv, "eionrobb-translate-state");
+	return state == NULL || g_queue_is_empty(&state->ordered);
+}
+
+static void
+translate_conv_state_invalidate(PurpleConversation *conv)
+{
+	TranslateConvState *state;
+	
+	if (conv == NULL)
+		return;
+	
+	state = purple_conversation_get_data(conv, "eionrobb-translate-state");
+	if (state != NULL)
+		state->generation = 0;
+}
+
+static gboolean translate_conv_reorder_timeout_cb(gpointer userdata);
+
+/** An outgoing message saved from last time, waiting for its account to sign on
+  * (or its room to be joined) to be sent again */
+typedef struct {
+	gchar *username;
+	gchar *protocol_id;
+	PurpleConversationType type;
+	gchar *name; //who it's to, or the room
+	gchar *message;
+} TranslateOutboxEntry;
+
+/** Outgoing messages that haven't gone yet, written out to translate_outbox_filename
+  * whenever they change, so that they're sent next time rather than lost if we're
+  * closed (or crash) while they wait on a translator */
+static GList *translate_outbox = NULL; //TranslateConvMessages
+static GList *translate_outbox_saved = NULL; //TranslateOutboxEntries not yet sent again
+static gchar *translate_outbox_filename = NULL;
+static guint translate_outbox_timer = 0;
+static guint translate_outbox_restored = 0;
+
+static void
+translate_outbox_entry_free(gpointer data)
+{
+	TranslateOutboxEntry *entry = data;
+	
+	g_free(entry->username);
+	g_free(entry->protocol_id);
+	g_free(entry->name);
+	g_free(entry->message);
+	g_free(entry);
+}
+
+static void
+translate_outbox_add_group(GKeyFile *keyfile, guint *count, const gchar *username, const gchar *protocol_id, PurpleConversationType type, const gchar *name, const gchar *message)
+{
+	gchar *group;
+	
+	group = g_strdup_printf("message%u", (*count)++);
+	g_key_file_set_string(keyfile, group, "account", username);
+	g_key_file_set_string(keyfile, group, "protocol", protocol_id);
+	g_key_file_set_string(keyfile, group, "type", type == PURPLE_CONV_TYPE_CHAT ? "chat" : "im");
+	g_key_file_set_string(keyfile, group, "to", name);
+	g_key_file_set_string(keyfile, group, "message", message);
+	g_free(group);
+}
+
+static void
+translate_outbox_write(void)
+{
+	struct TranslateConvMessage *convmsg;
+	TranslateOutboxEntry *entry;
+	GKeyFile *keyfile;
+	GError *error = NULL;
+	gchar *data;
+	gsize len;
+	guint count = 0;
+	GList *l;
+	
+	if (translate_outbox_timer)
+		purple_timeout_remove(translate_outbox_timer);
+	translate_outbox_timer = 0;
+	
+	keyfile = g_key_file_new();
+	for(l = translate_outbox; l; l = l->next)
+	{
+		convmsg = l->data;
+		if (convmsg->sender != NULL)
+			translate_outbox_add_group(keyfile, &count, purple_account_get_username(convmsg->account), purple_account_get_protocol_id(convmsg->account),
+			                           PURPLE_CONV_TYPE_IM, convmsg->sender, convmsg->original_phrase);
+		else if (convmsg->conv != NULL)
+			translate_outbox_add_group(keyfile, &count, purple_account_get_username(convmsg->account), purple_account_get_protocol_id(convmsg->account),
+			                           PURPLE_CONV_TYPE_CHAT, convmsg->conv->name, convmsg->original_phrase);
+	}
+	for(l = translate_outbox_saved; l; l = l->next)
+	{
+		entry = l->data;
+		translate_outbox_add_group(keyfile, &count, entry->username, entry->protocol_id, entry->type, entry->name, entry->message);
+	}
+	
+	if (count == 0)
+	{
+		g_unlink(translate_outbox_filename);
+		g_key_file_free(keyfile);
+		return;
+	}
+	
+	data = g_key_file_to_data(keyfile, &len, NULL);
+	if (!g_file_set_contents(translate_outbox_filename, data, len, &error))
+	{
+		purple_debug_error("translate", "Couldn't save the outgoing messages to %s: %s\n", translate_outbox_filename, error->message);
+		g_error_free(error);
+	}
+	g_free(data);
+	g_key_file_free(keyfile);
+}
+
+static gboolean
+translate_outbox_timeout_cb(gpointer userdata)
+{
+	translate_outbox_timer = 0;
+	translate_outbox_write();
+	
+	return FALSE;
+}
+
+/** Saves the outbox soon, so a burst of messages is written out once */
+static void
+translate_outbox_changed(void)
+{
+	if (!translate_outbox_timer)
+		translate_outbox_timer = purple_timeout_add(1000, translate_outbox_timeout_cb, NULL);
+}
+
+static void
+translate_outbox_add(struct TranslateConvMessage *convmsg)
+{
+	convmsg->outbox = TRUE;
+	translate_outbox = g_list_append(translate_outbox, convmsg);
+	translate_outbox_changed();
+}
+
+static void
+translate_outbox_remove(struct TranslateConvMessage *convmsg)
+{
+	if (!convmsg->outbox)
+		return;
+	
+	convmsg->outbox = FALSE;
+	translate_outbox = g_list_remove(translate_outbox, convmsg);
+	translate_outbox_changed();
+}
+
+static void
+translate_conv_message_free(struct TranslateConvMessage *convmsg)
+{
+	TranslateConvState *state;
+	
+	if (convmsg->conv != NULL)
+	{
+		state = purple_conversation_get_data(convmsg->conv, "eionrobb-translate-state");
+		if (state != NULL)
+			state->pending = g_list_remove(state->pending, convmsg);
+	}
+	translate_outbox_remove(convmsg);
+	
+	translate_arena_reset(&convmsg->arena);
+	
+	if (translate_conv_message_pool_size >= TRANSLATE_POOL_MAX)
+	{
+		translate_arena_free(&convmsg->arena);
+		g_free(convmsg);
+		return;
+	}
+	
+	convmsg->next_free = translate_conv_message_pool;
+	translate_conv_message_pool = convmsg;
+	translate_conv_message_pool_size++;
+}
+
+/** Frees everything kept for reuse, once nothing can be using it any more */
+static void
+translate_pools_clear(void)
+{
+	struct _TranslateStore *store;
+	struct TranslateConvMessage *convmsg;
+	
+	while ((store = translate_store_pool) != NULL)
+	{
+		translate_store_pool = store->next_free;
+		translate_arena_free(&store->arena);
+		g_free(store);
+	}
+	translate_store_pool_size = 0;
+	
+	while ((convmsg = translate_conv_message_pool) != NULL)
+	{
+		translate_conv_message_pool = convmsg->next_free;
+		translate_arena_free(&convmsg->arena);
+		g_free(convmsg);
+	}
+	translate_conv_message_pool_size = 0;
+}
+
+/** Hands a message over to be written or sent */
+static void
+translate_conv_message_release(struct TranslateConvMessage *convmsg)
+{
+	translate_outbox_remove(convmsg);
+	
+	if (convmsg->translated)
+		convmsg->release(convmsg, convmsg->original_phrase, convmsg->translated_phrase, convmsg->detected_language, convmsg->error_message);
+	else
+		convmsg->release(convmsg, convmsg->original_phrase, convmsg->original_phrase, NULL, "It took too long to translate");
+}
+
+/** Releases every translated message at the head of the conversation's queue, then
+  * gives whatever is left at the head reorder_timeout to turn up */
+static void
+translate_conv_flush(PurpleConversation *conv)
+{
+	TranslateConvState *state = translate_conv_state(conv);
+	struct TranslateConvMessage *convmsg;
+	
+	while ((convmsg = g_queue_peek_head(&state->ordered)) && convmsg->translated)
+	{
+		g_queue_pop_head(&state->ordered);
+		translate_conv_message_release(convmsg);
+		translate_conv_message_free(convmsg);
+	}
+	
+	if (state->reorder_timer)
+		purple_timeout_remove(state->reorder_timer);
+	state->reorder_timer = 0;
+	
+	if (!g_queue_is_empty(&state->ordered))
+		state->reorder_timer = purple_timeout_add(translate_config.reorder_timeout, translate_conv_reorder_timeout_cb, conv);
+}
+
+static gboolean
+translate_conv_reorder_timeout_cb(gpointer userdata)
+{
+	PurpleConversation *conv = userdata;
+	TranslateConvState *state = translate_conv_state(conv);
+	struct TranslateConvMessage *convmsg;
+	
+	state->reorder_timer = 0;
+	
+	// Let it through as it was rather than hold up everything behind it; it's
+	// freed when its translation finally comes back
+	convmsg = g_queue_pop_head(&state->ordered);
+	if (convmsg != NULL && convmsg->outbox)
+	{
+		// Something we're sending is still being translated (or retried), so it stays
+		// in the outbox and goes out on its own once it's done, rather than untranslated
+		purple_debug_info("translate", "Message %u in %s is taking a while, sending it once it's translated\n", convmsg->seq, conv->name);
+		convmsg->detached = TRUE;
+	} else if (convmsg != NULL) {
+		purple_debug_info("translate", "Message %u in %s took too long, showing it untranslated\n", convmsg->seq, conv->name);
+		convmsg->released = TRUE;
+		translate_conv_message_release(convmsg);
+	}
+	
+	translate_conv_flush(conv);
+	
+	return FALSE;
+}
 
-	next_pos = input_string = g_strdup(input);
+/** Translated messages whose conversation closed while they waited their turn,
+  * released from the main loop rather than while the conversation is going away */
+static GQueue translate_conv_orphans = G_QUEUE_INIT;
+static guint translate_conv_orphans_timer = 0;
 
-	while ((next_pos = strstr(next_pos, "\\u")))
+static gboolean
+translate_conv_orphans_cb(gpointer userdata)
+{
+	struct TranslateConvMessage *convmsg;
+	
+	translate_conv_orphans_timer = 0;
+	while ((convmsg = g_queue_pop_head(&translate_conv_orphans)))
 	{
-		/* grab the unicode */
-		sscanf(next_pos, "\\u%4x", &unicode_char);
-		/* turn it to a char* */
-		unicode_char_len = g_unichar_to_utf8(unicode_char, unicode_char_str);
-		/* shove it back into the string */
-		g_memmove(next_pos, unicode_char_str, unicode_char_len);
-		/* move all the data after the \u0000 along */
-		g_stpcpy(next_pos + unicode_char_len, next_pos + 6);
+		translate_conv_message_release(convmsg);
+		translate_conv_message_free(convmsg);
 	}
-
-	output_string = g_strcompress(input_string);
-	g_free(input_string);
-
-	return output_string;
+	
+	return FALSE;
 }
 
-const gchar *
-get_language_name(const gchar *language_key)
+static void
+translate_conv_state_free(PurpleConversation *conv)
 {
+	TranslateConvState *state;
+	struct TranslateConvMessage *convmsg;
 	GList *l;
-	const gchar *language_name = NULL;
-	PurpleKeyValuePair *pair = NULL;
 	
-	for(l = supported_languages; l; l = l->next)
+	state = purple_conversation_get_data(conv, "eionrobb-translate-state");
+	if (state == NULL)
+		return;
+	
+	if (state->reorder_timer)
+		purple_timeout_remove(state->reorder_timer);
+	if (state->draft_timer)
+		purple_timeout_remove(state->draft_timer);
+	
+	// Drafts are translated on the state's behalf, so nothing else is waiting on them
+	translate_cancel(state, "The conversation was closed");
+	
+	// Anything still being translated finds out the conversation is gone when it comes back
+	for(l = state->pending; l; l = l->next)
+	{
+		convmsg = l->data;
+		convmsg->conv = NULL;
+	}
+	g_list_free(state->pending);
+	
+	// Translated messages that were waiting their turn go out once the conversation is
+	// gone, if there's still somewhere for them to go
+	while ((convmsg = g_queue_pop_head(&state->ordered)))
 	{
-		pair = (PurpleKeyValuePair *) l->data;
-		if (g_str_equal(pair->key, language_key))
+		if (!convmsg->translated)
+			continue;
+		if (conv->type == PURPLE_CONV_TYPE_CHAT)
 		{
-			language_name = pair->value;
-			break;
+			translate_conv_message_free(convmsg);
+			continue;
 		}
+		g_queue_push_tail(&translate_conv_orphans, convmsg);
+		if (!translate_conv_orphans_timer)
+			translate_conv_orphans_timer = purple_timeout_add(0, translate_conv_orphans_cb, NULL);
 	}
 	
-	return language_name;
+	if (state->senders != NULL)
+		g_hash_table_destroy(state->senders);
+	g_free(state->draft);
+	g_free(state->stored_lang);
+	g_free(state);
+	purple_conversation_set_data(conv, "eionrobb-translate-state", NULL);
 }
 
-void
-google_translate_cb(PurpleUtilFetchUrlData *url_data, gpointer user_data, const gchar *url_text, gsize len, const gchar *error_message)
+/** Takes a message that's about to be translated.  Messages in the same conversation
+  * are released in the order they were made here, however their translations arrive */
+static struct TranslateConvMessage *
+translate_conv_message_new(PurpleAccount *account, const gchar *sender, PurpleConversation *conv, PurpleMessageFlags flags, const gchar *original_phrase, TranslateConvRelease release)
 {
-	struct _TranslateStore *store = user_data;
-	const gchar *trans_start = "\"translatedText\":\"";
-	const gchar *lang_start = "\"detectedSourceLanguage\":\"";
-	gchar *strstart = NULL;
-	gchar *translated = NULL;
-	gchar *lang = NULL;
-
-	purple_debug_info("translate", "Got response: %s\n", url_text);
+	struct TranslateConvMessage *convmsg;
+	TranslateConvState *state;
+	TranslateArena arena;
 	
-	strstart = g_strstr_len(url_text, len, trans_start);
-	if (strstart)
+	convmsg = translate_conv_message_pool;
+	if (convmsg != NULL)
 	{
-		strstart = strstart + strlen(trans_start);
-		translated = g_strndup(strstart, strchr(strstart, '"') - strstart);
+		translate_conv_message_pool = convmsg->next_free;
+		translate_conv_message_pool_size--;
+		translate_pool_reused++;
 		
-		strstart = convert_unicode(translated);
-		g_free(translated);
-		translated = strstart;
+		arena = convmsg->arena;
+		memset(convmsg, 0, sizeof(struct TranslateConvMessage));
+		convmsg->arena = arena;
+	} else {
+		convmsg = g_new0(struct TranslateConvMessage, 1);
 	}
 	
-	strstart = g_strstr_len(url_text, len, lang_start);
-	if (strstart)
+	// Room for the sender, the message and most translations of it
+	translate_arena_reserve(&convmsg->arena, (sender ? strlen(sender) : 0) + strlen(original_phrase) * 3 + 128);
+	convmsg->account = account;
+	convmsg->sender = translate_arena_strdup(&convmsg->arena, sender);
+	convmsg->conv = conv;
+	convmsg->flags = flags;
+	convmsg->release = release;
+	convmsg->when = time(NULL);
+	convmsg->original_phrase = translate_arena_strdup(&convmsg->arena, original_phrase);
+	
+	if (conv != NULL)
 	{
-		strstart = strstart + strlen(lang_start);
-		lang = g_strndup(strstart, strchr(strstart, '"') - strstart);
+		state = translate_conv_state(conv);
+		convmsg->seq = state->next_seq++;
+		state->pending = g_list_prepend(state->pending, convmsg);
+		g_queue_push_tail(&state->ordered, convmsg);
+		if (!state->reorder_timer)
+			state->reorder_timer = purple_timeout_add(translate_config.reorder_timeout, translate_conv_reorder_timeout_cb, conv);
 	}
 	
-	store->callback(store->original_phrase, translated, lang, store->userdata);
-	
-	g_free(translated);
-	g_free(lang);
-	g_free(store->original_phrase);
-	g_free(store);
+	return convmsg;
 }
 
-void
-google_translate(const gchar *plain_phrase, const gchar *from_lang, const gchar *to_lang, TranslateCallback callback, gpointer userdata)
+/** The TranslateCallback for conversation messages */
+static void
+translate_conv_message_cb(const gchar *original_phrase, const gchar *translated_phrase, const gchar *detected_language, const gchar *error_message, gpointer userdata)
 {
-	gchar *encoded_phrase;
-	gchar *url;
-	struct _TranslateStore *store;
-	
-	encoded_phrase = g_strdup(purple_url_encode(plain_phrase));
-	
-	if (!from_lang || g_str_equal(from_lang, "auto"))
-		from_lang = "";
-	
-	url = g_strdup_printf("http://ajax.googleapis.com/ajax/services/language/translate?v=1.0&langpair=%s%%7C%s&q=%s",
-							from_lang, to_lang, encoded_phrase);
+	struct TranslateConvMessage *convmsg = userdata;
 	
-	store = g_new0(struct _TranslateStore, 1);
-	store->original_phrase = g_strdup(plain_phrase);
-	store->callback = callback;
-	store->userdata = userdata;
+	if (convmsg->released)
+	{
+		// Already shown untranslated
+		translate_conv_message_free(convmsg);
+		return;
+	}
 	
-	purple_debug_info("translate", "Fetching %s\n", url);
+	convmsg->translated = TRUE;
+	convmsg->translated_phrase = translate_arena_strdup(&convmsg->arena, translated_phrase);
+	convmsg->detected_language = detected_language;
+	convmsg->error_message = translate_arena_strdup(&convmsg->arena, error_message);
 	
-	purple_util_fetch_url_request(url, TRUE, "libpurple", FALSE, NULL, FALSE, google_translate_cb, store);
+	if (convmsg->conv == NULL || convmsg->detached)
+	{
+		// Nothing left to keep it in order with
+		translate_conv_message_release(convmsg);
+		translate_conv_message_free(convmsg);
+		return;
+	}
 	
-	g_free(encoded_phrase);
-	g_free(url);
+	translate_conv_flush(convmsg->conv);
 }
 
-void
-bing_translate_cb(PurpleUtilFetchUrlData *url_data, gpointer user_data, const gchar *url_text, gsize len, const gchar *error_message)
+/** Whether whatever called back with userdata still wants the answer */
+static gboolean
+translate_callback_wanted(TranslateCallback callback, gpointer userdata)
 {
-	struct _TranslateStore *store = user_data;
-	gchar *translated = NULL;
-	gchar *temp;
-
-	purple_debug_info("translate", "Got response: %s\n", url_text);
-	
-	temp = strchr(url_text, '"') + 1; 
-	temp = g_strndup(temp, len - (temp - url_text) - 1);
-	
-	translated = convert_unicode(temp);
-	g_free(temp);
+	TranslateMultipartSlot *slot;
+	struct TranslateConvMessage *convmsg;
 	
-	store->callback(store->original_phrase, translated, store->detected_language, store->userdata);
+	if (callback == translate_multipart_part_cb)
+	{
+		slot = userdata;
+		return translate_callback_wanted(slot->multipart->callback, slot->multipart->userdata);
+	}
+	if (callback == translate_hedge_store_cb)
+		return translate_store_wanted(userdata);
+	if (callback == translate_conv_message_cb)
+	{
+		// Once it's gone out untranslated its translation is only freed
+		convmsg = userdata;
+		return !convmsg->released;
+	}
 	
-	g_free(translated);
-	g_free(store->detected_language);
-	g_free(store->original_phrase);
-	g_free(store);
+	return TRUE;
 }
 
-void
-bing_translate_autodetect_cb(PurpleUtilFetchUrlData *url_data, gpointer user_data, const gchar *url_text, gsize len, const gchar *error_message)
+/** Whether a store, or any store waiting on it, still has somebody waiting on its answer */
+static gboolean
+translate_store_wanted(struct _TranslateStore *store)
 {
-	struct _TranslateStore *store = user_data;
-	gchar *from_lang = NULL;
-	gchar *to_lang;
-	gchar *encoded_phrase;
-	gchar *url;
+	GSList *l;
 	
-	purple_debug_info("translate", "Got response: %s\n", url_text);
-	
-	if (!url_text || !len || g_strstr_len(url_text, len, "\"\""))
-	{
-		// Unknown language
-		store->callback(store->original_phrase, store->original_phrase, NULL, store->userdata);
-		g_free(store->detected_language);
-		g_free(store->original_phrase);
-		g_free(store);
-		
-	} else {
+	if (translate_callback_wanted(store->callback, store->userdata))
+		return TRUE;
+	for(l = store->waiters; l; l = l->next)
+		if (translate_store_wanted(l->data))
+			return TRUE;
 	
-		from_lang = strchr(url_text, '"') + 1; 
-		from_lang = g_strndup(from_lang, len - (from_lang - url_text) - 1);
-		
-		to_lang = store->detected_language;
-		store->detected_language = from_lang;
-		
-		// Same as bing_translate() but we've already made the _TranslateStore
-		encoded_phrase = g_strescape(purple_url_encode(store->original_phrase), NULL);
-		url = g_strdup_printf("http://api.microsofttranslator.com/V2/Ajax.svc/Translate?appId=" BING_APPID "&text=%%22%s%%22&from=%s&to=%s",
-						encoded_phrase, from_lang, to_lang);
-		purple_debug_info("translate", "Fetching %s\n", url);
-		
-		purple_util_fetch_url_request(url, TRUE, "libpurple", FALSE, NULL, FALSE, bing_translate_cb, store);
-		
-		g_free(to_lang);
-		g_free(encoded_phrase);
-		g_free(url);
-	}
+	return FALSE;
 }
 
-void
-bing_translate(const gchar *plain_phrase, const gchar *from_lang, const gchar *to_lang, TranslateCallback callback, gpointer userdata)
+static void
+translate_conv_write_error(PurpleConversation *conv, const gchar *what, const gchar *error_message)
 {
-	gchar *encoded_phrase;
-	gchar *url;
-	struct _TranslateStore *store;
-	PurpleUtilFetchUrlCallback urlcallback;
-	
-	encoded_phrase = g_strescape(purple_url_encode(plain_phrase), NULL);
-	
-	store = g_new0(struct _TranslateStore, 1);
-	store->original_phrase = g_strdup(plain_phrase);
-	store->callback = callback;
-	store->userdata = userdata;
-	
-	if (!from_lang || !(*from_lang) || g_str_equal(from_lang, "auto"))
-	{
-		url = g_strdup_printf("http://api.microsofttranslator.com/V2/Ajax.svc/Detect?appId=" BING_APPID "&text=%%22%s%%22",
-						encoded_phrase);
-		store->detected_language = g_strdup(to_lang);
-		urlcallback = bing_translate_autodetect_cb;
-	} else {
-		url = g_strdup_printf("http://api.microsofttranslator.com/V2/Ajax.svc/Translate?appId=" BING_APPID "&text=%%22%s%%22&from=%s&to=%s",
-						encoded_phrase, from_lang, to_lang);
-		urlcallback = bing_translate_cb;
-	}
+	gchar *message;
 	
-	purple_debug_info("translate", "Fetching %s\n", url);
+	message = g_strdup_printf("%s: %s", what, error_message);
+	purple_conversation_write(conv, NULL, message, PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_ERROR | PURPLE_MESSAGE_NO_LOG, time(NULL));
+	g_free(message);
+}
+
+/** Remembers the language we detected for the conversation's buddy or chat */
+static void
+translate_conv_store_language(PurpleConversation *conv, const gchar *detected_language)
+{
+	TranslateConvState *state = translate_conv_state(conv);
 	
-	purple_util_fetch_url_request(url, TRUE, "libpurple", FALSE, NULL, FALSE, urlcallback, store);
+	if (state->node == NULL)
+		return;
 	
-	g_free(encoded_phrase);
-	g_free(url);
+	purple_blist_node_set_string(state->node, "eionrobb-translate-lang", detected_language);
+	translate_conv_state_invalidate(conv);
 }
 
-struct TranslateConvMessage {
-	PurpleAccount *account;
-	gchar *sender;
-	PurpleConversation *conv;
-	PurpleMessageFlags flags;
-};
-
-void
-translate_receiving_message_cb(const gchar *original_phrase, const gchar *translated_phrase, const gchar *detected_language, gpointer userdata)
+static void
+translate_receiving_message_release(struct TranslateConvMessage *convmsg, const gchar *original_phrase, const gchar *translated_phrase, const gchar *detected_language, const gchar *error_message)
 {
-	struct TranslateConvMessage *convmsg = userdata;
-	PurpleBuddy *buddy;
-	gchar *html_text;
-	const gchar *stored_lang = "";
 	const gchar *language_name = NULL;
 	gchar *message;
 	
+	// They were closed while we were translating, so open them again like any other IM would
+	if (convmsg->conv == NULL)
+		convmsg->conv = purple_conversation_new(PURPLE_CONV_TYPE_IM, convmsg->account, convmsg->sender);
+	
 	if (detected_language)
 	{
-		buddy = purple_find_buddy(convmsg->account, convmsg->sender);
-		stored_lang = purple_blist_node_get_string((PurpleBlistNode *)buddy, "eionrobb-translate-lang");
-		purple_blist_node_set_string((PurpleBlistNode *)buddy, "eionrobb-translate-lang", detected_language);
+		translate_conv_store_language(convmsg->conv, detected_language);
 		
 		language_name = get_language_name(detected_language);
 		
@@ -294,13 +5213,10 @@ translate_receiving_message_cb(const gchar *original_phrase, const gchar *transl
 		}
 	}
 	
-	html_text = purple_strdup_withhtml(translated_phrase);
+	purple_conversation_write(convmsg->conv, convmsg->sender, translated_phrase, convmsg->flags, convmsg->when);
 	
-	purple_conversation_write(convmsg->conv, convmsg->sender, html_text, convmsg->flags, time(NULL));
-	
-	g_free(html_text);
-	g_free(convmsg->sender);
-	g_free(convmsg);
+	if (error_message != NULL)
+		translate_conv_write_error(convmsg->conv, "Couldn't translate that message", error_message);
 }
 
 gboolean
@@ -309,48 +5225,56 @@ translate_receiving_im_msg(PurpleAccount *account, char **sender,
                              PurpleMessageFlags *flags)
 {
 	struct TranslateConvMessage *convmsg;
-	const gchar *stored_lang = "auto";
-	gchar *stripped;
+	const gchar *stored_lang = NULL;
+	const TranslateLanguage *language;
+	GArray *spans;
 	const gchar *to_lang;
-	PurpleBuddy *buddy;
-	const gchar *service_to_use = "";
+	PurpleBlistNode *node;
+	TranslateBackend *backend;
+	TranslateConvState *state;
 	
-	buddy = purple_find_buddy(account, *sender);
-	service_to_use = purple_prefs_get_string("/plugins/core/eionrobb-libpurple-translate/service");
-	to_lang = purple_prefs_get_string("/plugins/core/eionrobb-libpurple-translate/locale");
-	if (buddy)
-		stored_lang = purple_blist_node_get_string((PurpleBlistNode *)buddy, "eionrobb-translate-lang");
+	if (conv != NULL)
+	{
+		state = translate_conv_state(conv);
+		node = state->node;
+		stored_lang = state->stored_lang;
+		language = state->language;
+		backend = state->backend;
+	} else {
+		// First message from them, so there's no conversation to remember anything on yet
+		node = (PurpleBlistNode *) purple_find_buddy(account, *sender);
+		if (node)
+			stored_lang = purple_blist_node_get_string(node, "eionrobb-translate-lang");
+		language = translate_language_find(stored_lang);
+		backend = translate_config.backend;
+	}
+	to_lang = translate_config.locale->code;
 	if (!stored_lang)
 		stored_lang = "auto";
-	if (!buddy || !service_to_use || g_str_equal(stored_lang, "none") || g_str_equal(stored_lang, to_lang))
+	if (!node || !backend || g_str_equal(stored_lang, "none") || language == translate_config.locale)
 	{
 		//Allow the message to go through as per normal
 		return FALSE;
 	}
 	
+	spans = translate_markup_split(*message);
+	if (spans == NULL && translate_conv_idle(conv))
+	{
+		// Nothing to translate, so let it through untouched
+		translate_fast_path_messages++;
+		return FALSE;
+	}
+	
 	if (conv == NULL)
 		conv = purple_conversation_new(PURPLE_CONV_TYPE_IM, account, *sender);
 	
-	stripped = purple_markup_strip_html(*message);
-	
-	convmsg = g_new0(struct TranslateConvMessage, 1);
-	convmsg->account = account;
-	convmsg->sender = *sender;
-	convmsg->conv = conv;
-	convmsg->flags = *flags;
-	
-	if (g_str_equal(service_to_use, "google"))
-	{
-		google_translate(stripped, stored_lang, to_lang, translate_receiving_message_cb, convmsg);
-	} else if (g_str_equal(service_to_use, "bing"))
-	{
-		bing_translate(stripped, stored_lang, to_lang, translate_receiving_message_cb, convmsg);
-	}
+	convmsg = translate_conv_message_new(account, *sender, conv, *flags, *message, translate_receiving_message_release);
 	
-	g_free(stripped);
+	translate_markup(backend, *message, spans, stored_lang, to_lang, TRANSLATE_PRIORITY_IM, conv, translate_conv_message_cb, convmsg);
 	
 	g_free(*message);
 	*message = NULL;
+	g_free(*sender);
 	*sender = NULL;
 	
 	//Cancel the message
@@ -358,39 +5282,154 @@ translate_receiving_im_msg(PurpleAccount *account, char **sender,
 }
 
 
-void
-translate_receiving_chat_msg_cb(const gchar *original_phrase, const gchar *translated_phrase, const gchar *detected_language, gpointer userdata)
+/** The language one person in a chat writes in.  A room full of people each writing
+  * in their own language is tracked per sender rather than flipping the whole room's
+  * language with every message */
+typedef struct {
+	GList link; //in the conversation's senders_lru, data pointing back here
+	const gchar *language; //interned
+	guint8 confidence; //detections that agreed, less ones that didn't
+	gint64 learned; //ms, when it was last detected
+	gchar name[1]; //the rest of the name follows, in the same allocation
+} TranslateChatSender;
+
+/** Most senders remembered in one chat; the ones heard from least recently go first */
+#define TRANSLATE_CHAT_SENDERS_MAX 512
+
+/** Detections that have to agree before a sender's messages skip detection */
+#define TRANSLATE_CHAT_SENDER_TRUSTED 2
+#define TRANSLATE_CHAT_SENDER_CONFIDENCE_MAX 8
+
+/** Confidence halves this often (ms) without a detection, so a sender is checked
+  * again now and then in case they've changed language */
+#define TRANSLATE_CHAT_SENDER_HALF_LIFE (15 * 60 * 1000)
+
+static guint translate_chat_senders_known = 0;
+static guint translate_chat_senders_forgotten = 0;
+
+static guint
+translate_chat_sender_confidence(TranslateChatSender *chat_sender, gint64 now)
+{
+	gint64 halvings = (now - chat_sender->learned) / TRANSLATE_CHAT_SENDER_HALF_LIFE;
+	
+	if (halvings >= 8)
+		return 0;
+	return chat_sender->confidence >> halvings;
+}
+
+/** The language sender is known to write in, or NULL if we're not sure enough yet */
+static const gchar *
+translate_chat_sender_language(TranslateConvState *state, const gchar *sender)
+{
+	TranslateChatSender *chat_sender;
+	
+	if (state->senders == NULL || sender == NULL)
+		return NULL;
+	
+	chat_sender = g_hash_table_lookup(state->senders, sender);
+	if (chat_sender == NULL)
+		return NULL;
+	
+	g_queue_unlink(&state->senders_lru, &chat_sender->link);
+	g_queue_push_head_link(&state->senders_lru, &chat_sender->link);
+	
+	if (translate_chat_sender_confidence(chat_sender, translate_now_ms()) < TRANSLATE_CHAT_SENDER_TRUSTED)
+		return NULL;
+	
+	translate_chat_senders_known++;
+	return chat_sender->language;
+}
+
+/** Records a detected language for sender, returning TRUE if it's not the language
+  * they were thought to write in before */
+static gboolean
+translate_chat_sender_learn(TranslateConvState *state, const gchar *sender, const gchar *language)
+{
+	TranslateChatSender *chat_sender;
+	gint64 now = translate_now_ms();
+	guint confidence;
+	gsize len;
+	
+	if (sender == NULL)
+		return FALSE;
+	
+	if (state->senders == NULL)
+		state->senders = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+	
+	chat_sender = g_hash_table_lookup(state->senders, sender);
+	if (chat_sender == NULL)
+	{
+		while (g_queue_get_length(&state->senders_lru) >= TRANSLATE_CHAT_SENDERS_MAX)
+		{
+			chat_sender = g_queue_peek_tail(&state->senders_lru);
+			g_queue_unlink(&state->senders_lru, &chat_sender->link);
+			g_hash_table_remove(state->senders, chat_sender->name);
+			translate_chat_senders_forgotten++;
+		}
+		
+		len = strlen(sender);
+		chat_sender = g_malloc0(sizeof(TranslateChatSender) + len);
+		memcpy(chat_sender->name, sender, len + 1);
+		chat_sender->link.data = chat_sender;
+		chat_sender->language = language;
+		chat_sender->confidence = 1;
+		chat_sender->learned = now;
+		g_hash_table_insert(state->senders, chat_sender->name, chat_sender);
+		g_queue_push_head_link(&state->senders_lru, &chat_sender->link);
+		return TRUE;
+	}
+	
+	confidence = translate_chat_sender_confidence(chat_sender, now);
+	chat_sender->learned = now;
+	
+	if (chat_sender->language == language)
+	{
+		chat_sender->confidence = MIN(confidence + 1, TRANSLATE_CHAT_SENDER_CONFIDENCE_MAX);
+		return FALSE;
+	}
+	
+	// One odd detection (a name, a quote) shouldn't undo what we've seen before
+	if (confidence > 1)
+	{
+		chat_sender->confidence = confidence - 1;
+		return FALSE;
+	}
+	
+	chat_sender->language = language;
+	chat_sender->confidence = 1;
+	return TRUE;
+}
+
+static void
+translate_receiving_chat_msg_release(struct TranslateConvMessage *convmsg, const gchar *original_phrase, const gchar *translated_phrase, const gchar *detected_language, const gchar *error_message)
 {
-	struct TranslateConvMessage *convmsg = userdata;
-	PurpleChat *chat;
-	gchar *html_text;
-	const gchar *stored_lang = "";
 	const gchar *language_name = NULL;
 	gchar *message;
 	
-	if (detected_language)
+	if (convmsg->conv == NULL)
+	{
+		// Left the room while we were translating
+		return;
+	}
+	
+	// Only messages from a room in auto are detected, and each sender keeps their own
+	// language rather than the room taking on whichever it heard last
+	if (detected_language && translate_chat_sender_learn(translate_conv_state(convmsg->conv), convmsg->sender, detected_language))
 	{
-		chat = purple_blist_find_chat(convmsg->account, convmsg->conv->name);
-		stored_lang = purple_blist_node_get_string((PurpleBlistNode *)chat, "eionrobb-translate-lang");
-		purple_blist_node_set_string((PurpleBlistNode *)chat, "eionrobb-translate-lang", detected_language);
-		
 		language_name = get_language_name(detected_language);
 		
-		if (language_name != NULL)
+		if (language_name != NULL && convmsg->sender != NULL)
 		{
-			message = g_strdup_printf("Now translating to %s (auto-detected)", language_name);
+			message = g_strdup_printf("Translating %s from %s (auto-detected)", convmsg->sender, language_name);
 			purple_conversation_write(convmsg->conv, NULL, message, PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG, time(NULL));
 			g_free(message);
 		}
 	}
 	
-	html_text = purple_strdup_withhtml(translated_phrase);
+	purple_conversation_write(convmsg->conv, convmsg->sender, translated_phrase, convmsg->flags, convmsg->when);
 	
-	purple_conversation_write(convmsg->conv, convmsg->sender, html_text, convmsg->flags, time(NULL));
-	
-	g_free(html_text);
-	g_free(convmsg->sender);
-	g_free(convmsg);
+	if (error_message != NULL)
+		translate_conv_write_error(convmsg->conv, "Couldn't translate that message", error_message);
 }
 
 gboolean
@@ -399,202 +5438,501 @@ translate_receiving_chat_msg(PurpleAccount *account, char **sender,
                              PurpleMessageFlags *flags)
 {
 	struct TranslateConvMessage *convmsg;
-	const gchar *stored_lang = "auto";
-	gchar *stripped;
+	const gchar *stored_lang;
+	const gchar *from_lang;
+	GArray *spans;
 	const gchar *to_lang;
-	PurpleChat *chat;
-	const gchar *service_to_use = "";
+	TranslateConvState *state;
+	
+	if (conv == NULL)
+		return FALSE;
 	
-	chat = purple_blist_find_chat(account, conv->name);
-	service_to_use = purple_prefs_get_string("/plugins/core/eionrobb-libpurple-translate/service");
-	to_lang = purple_prefs_get_string("/plugins/core/eionrobb-libpurple-translate/locale");
-	if (chat)
-		stored_lang = purple_blist_node_get_string((PurpleBlistNode *)chat, "eionrobb-translate-lang");
+	state = translate_conv_state(conv);
+	to_lang = translate_config.locale->code;
+	stored_lang = state->stored_lang;
 	if (!stored_lang)
 		stored_lang = "auto";
-	if (!chat || !service_to_use || g_str_equal(stored_lang, "none") || g_str_equal(stored_lang, to_lang))
+	if (!state->node || !state->backend || g_str_equal(stored_lang, "none") || state->language == translate_config.locale)
 	{
 		//Allow the message to go through as per normal
 		return FALSE;
 	}
 	
-	stripped = purple_markup_strip_html(*message);
-	
-	convmsg = g_new0(struct TranslateConvMessage, 1);
-	convmsg->account = account;
-	convmsg->sender = *sender;
-	convmsg->conv = conv;
-	convmsg->flags = *flags;
+	// Someone we've already heard enough from goes straight to the translator, without
+	// detecting their language again
+	from_lang = stored_lang;
+	if (g_str_equal(stored_lang, "auto"))
+		from_lang = translate_chat_sender_language(state, *sender);
+	if (from_lang == NULL)
+		from_lang = "auto";
 	
-	if (g_str_equal(service_to_use, "google"))
+	spans = translate_markup_split(*message);
+	if (spans != NULL && g_str_equal(from_lang, to_lang))
 	{
-		google_translate(stripped, stored_lang, to_lang, translate_receiving_chat_msg_cb, convmsg);
-	} else if (g_str_equal(service_to_use, "bing"))
+		// Already in our language, but it may still have to wait its turn
+		g_array_free(spans, TRUE);
+		spans = NULL;
+	}
+	if (spans == NULL && translate_conv_idle(conv))
 	{
-		bing_translate(stripped, stored_lang, to_lang, translate_receiving_chat_msg_cb, convmsg);
+		translate_fast_path_messages++;
+		return FALSE;
 	}
 	
-	g_free(stripped);
+	convmsg = translate_conv_message_new(account, *sender, conv, *flags, *message, translate_receiving_chat_msg_release);
+	
+	translate_markup(state->backend, *message, spans, from_lang, to_lang, TRANSLATE_PRIORITY_CHAT, conv, translate_conv_message_cb, convmsg);
 	
 	g_free(*message);
 	*message = NULL;
+	g_free(*sender);
 	*sender = NULL;
 	
-	if (conv == NULL)
+	//Cancel the message
+	return TRUE;
+}
+
+static void
+translate_sending_message_release(struct TranslateConvMessage *convmsg, const gchar *original_phrase, const gchar *translated_phrase, const gchar *detected_language, const gchar *error_message)
+{
+	int err = 0;
+	
+	err = serv_send_im(purple_account_get_connection(convmsg->account), convmsg->sender, translated_phrase, convmsg->flags);
+	
+	if (err > 0 && convmsg->conv != NULL)
 	{
-		// Fake receiving a message to open the conversation window
-		*message = g_strdup(" ");
-		*flags |= PURPLE_MESSAGE_INVISIBLE | PURPLE_MESSAGE_NO_LOG;
-		return FALSE;
+		purple_conversation_write(convmsg->conv, convmsg->sender, original_phrase, convmsg->flags, time(NULL));
 	}
+	if (error_message != NULL && convmsg->conv != NULL)
+		translate_conv_write_error(convmsg->conv, "Sent that message untranslated", error_message);
+	
+	purple_signal_emit(purple_conversations_get_handle(), "sent-im-msg",
+						convmsg->account, convmsg->sender, original_phrase);
+}
+
+static guint translate_drafts_sent = 0;
+static guint translate_drafts_over_budget = 0;
+static guint translate_drafts_used = 0;
+
+/** Stops translating the conversation's draft, now that it's been sent or thrown away */
+static void
+translate_draft_clear(PurpleConversation *conv)
+{
+	TranslateConvState *state;
+	
+	if (conv == NULL)
+		return;
+	
+	state = purple_conversation_get_data(conv, "eionrobb-translate-state");
+	if (state == NULL || (state->draft == NULL && !state->draft_timer))
+		return;
+	
+	if (state->draft_timer)
+		purple_timeout_remove(state->draft_timer);
+	state->draft_timer = 0;
+	g_free(state->draft);
+	state->draft = NULL;
+	
+	// Anything a sent message needed has been taken over by it by now
+	translate_cancel(state, "The draft was finished with");
+}
+
+/** Sends a message straight away if its draft was already translated (or it's all in
+  * the cache anyway), rather than going through the queue.  Takes ownership of spans
+  * and returns TRUE if it was sent */
+static gboolean
+translate_draft_send(PurpleAccount *account, const gchar *receiver, PurpleConversation *conv, const gchar *message, GArray *spans, TranslateBackend *backend, const gchar *from_lang, const gchar *to_lang, TranslateConvRelease release)
+{
+	struct TranslateConvMessage *convmsg;
+	gchar *translated_phrase;
+	
+	if (!translate_config.speculate || spans == NULL || !translate_conv_idle(conv))
+		return FALSE;
+	
+	translated_phrase = translate_markup_lookup(backend, message, spans, from_lang, to_lang);
+	if (translated_phrase == NULL)
+		return FALSE;
+	
+	translate_drafts_used++;
+	g_array_free(spans, TRUE);
+	
+	// Nothing to keep it in order with, so it's never queued on the conversation
+	convmsg = translate_conv_message_new(account, receiver, NULL, PURPLE_MESSAGE_SEND, message, release);
+	convmsg->conv = conv;
+	release(convmsg, convmsg->original_phrase, translated_phrase, NULL, NULL);
+	translate_conv_message_free(convmsg);
+	g_free(translated_phrase);
+	
+	translate_draft_clear(conv);
 	
-	//Cancel the message
 	return TRUE;
 }
 
 void
-translate_sending_message_cb(const gchar *original_phrase, const gchar *translated_phrase, const gchar *detected_language, gpointer userdata)
+translate_sending_im_msg(PurpleAccount *account, const char *receiver, char **message)
+{
+	const gchar *from_lang = "";
+	TranslateBackend *backend;
+	const gchar *to_lang = NULL;
+	const TranslateLanguage *language;
+	PurpleBlistNode *node;
+	PurpleConversation *conv;
+	TranslateConvState *state;
+	struct TranslateConvMessage *convmsg;
+	GArray *spans;
+
+	from_lang = translate_config.locale->code;
+	conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_IM, receiver, account);
+	if (conv != NULL)
+	{
+		state = translate_conv_state(conv);
+		node = state->node;
+		to_lang = state->stored_lang;
+		language = state->language;
+		backend = state->backend;
+	} else {
+		node = (PurpleBlistNode *) purple_find_buddy(account, receiver);
+		if (node)
+			to_lang = purple_blist_node_get_string(node, "eionrobb-translate-lang");
+		language = translate_language_find(to_lang);
+		backend = translate_config.backend;
+	}
+	
+	if (!node || !backend || !to_lang || language == translate_config.locale || g_str_equal(to_lang, "auto"))
+	{
+		// Don't translate this message
+		return;
+	}
+	
+	spans = translate_markup_split(*message);
+	if (spans == NULL && translate_conv_idle(conv))
+	{
+		// Send it as it is
+		translate_fast_path_messages++;
+		return;
+	}
+	
+	if (!translate_draft_send(account, receiver, conv, *message, spans, backend, from_lang, to_lang, translate_sending_message_release))
+	{
+		convmsg = translate_conv_message_new(account, receiver, conv, PURPLE_MESSAGE_SEND, *message, translate_sending_message_release);
+		translate_outbox_add(convmsg);
+		
+		translate_markup(backend, *message, spans, from_lang, to_lang, TRANSLATE_PRIORITY_OUTGOING, conv, translate_conv_message_cb, convmsg);
+		translate_draft_clear(conv);
+	}
+	
+	g_free(*message);
+	*message = NULL;
+}
+
+static void
+translate_sending_chat_message_release(struct TranslateConvMessage *convmsg, const gchar *original_phrase, const gchar *translated_phrase, const gchar *detected_language, const gchar *error_message)
 {
-	struct TranslateConvMessage *convmsg = userdata;
-	gchar *html_text;
 	int err = 0;
 	
-	html_text = purple_strdup_withhtml(translated_phrase);
-	err = serv_send_im(purple_account_get_connection(convmsg->account), convmsg->sender, html_text, convmsg->flags);
-	g_free(html_text);
-	
-	html_text = purple_strdup_withhtml(original_phrase);
-	if (err > 0)
+	if (convmsg->conv == NULL)
 	{
-		purple_conversation_write(convmsg->conv, convmsg->sender, html_text, convmsg->flags, time(NULL));
+		// Left the room before it could be sent
+		return;
 	}
 	
-	purple_signal_emit(purple_conversations_get_handle(), "sent-im-msg",
-						convmsg->account, convmsg->sender, html_text);
+	err = serv_chat_send(purple_account_get_connection(convmsg->account), purple_conv_chat_get_id(PURPLE_CONV_CHAT(convmsg->conv)), translated_phrase, convmsg->flags);
+	
+	//if (err > 0)
+	//{
+	//	purple_conversation_write(convmsg->conv, convmsg->sender, original_phrase, convmsg->flags, time(NULL));
+	//}
+	if (error_message != NULL)
+		translate_conv_write_error(convmsg->conv, "Sent that message untranslated", error_message);
 	
-	g_free(html_text);
-	g_free(convmsg->sender);
-	g_free(convmsg);
+	purple_signal_emit(purple_conversations_get_handle(), "sent-chat-msg",
+						convmsg->account, original_phrase,
+						purple_conv_chat_get_id(PURPLE_CONV_CHAT(convmsg->conv)));
 }
 
 void
-translate_sending_im_msg(PurpleAccount *account, const char *receiver, char **message)
+translate_sending_chat_msg(PurpleAccount *account, char **message, int chat_id)
 {
 	const gchar *from_lang = "";
-	const gchar *service_to_use = "";
-	const gchar *to_lang = "";
-	PurpleBuddy *buddy;
+	const gchar *to_lang;
+	PurpleConversation *conv;
+	TranslateConvState *state;
 	struct TranslateConvMessage *convmsg;
-	gchar *stripped;
+	GArray *spans;
 
-	from_lang = purple_prefs_get_string("/plugins/core/eionrobb-libpurple-translate/locale");
-	service_to_use = purple_prefs_get_string("/plugins/core/eionrobb-libpurple-translate/service");
-	buddy = purple_find_buddy(account, receiver);
-	if (buddy)
-		to_lang = purple_blist_node_get_string((PurpleBlistNode *)buddy, "eionrobb-translate-lang");
+	from_lang = translate_config.locale->code;
+	conv = purple_find_chat(purple_account_get_connection(account), chat_id);
+	if (conv == NULL)
+		return;
+	
+	state = translate_conv_state(conv);
+	to_lang = state->stored_lang;
 	
-	if (!buddy || !service_to_use || !to_lang || g_str_equal(from_lang, to_lang) || g_str_equal(to_lang, "auto"))
+	if (!state->node || !state->backend || !to_lang || state->language == translate_config.locale || g_str_equal(to_lang, "auto"))
 	{
 		// Don't translate this message
 		return;
 	}
 	
-	stripped = purple_markup_strip_html(*message);
+	spans = translate_markup_split(*message);
+	if (spans == NULL && translate_conv_idle(conv))
+	{
+		translate_fast_path_messages++;
+		return;
+	}
 	
-	convmsg = g_new0(struct TranslateConvMessage, 1);
-	convmsg->account = account;
-	convmsg->sender = g_strdup(receiver);
-	convmsg->conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_IM, receiver, account);
-	convmsg->flags = PURPLE_MESSAGE_SEND;
+	if (!translate_draft_send(account, NULL, conv, *message, spans, state->backend, from_lang, to_lang, translate_sending_chat_message_release))
+	{
+		convmsg = translate_conv_message_new(account, NULL, conv, PURPLE_MESSAGE_SEND, *message, translate_sending_chat_message_release);
+		translate_outbox_add(convmsg);
+		
+		translate_markup(state->backend, *message, spans, from_lang, to_lang, TRANSLATE_PRIORITY_OUTGOING, conv, translate_conv_message_cb, convmsg);
+		translate_draft_clear(conv);
+	}
+	
+	g_free(*message);
+	*message = NULL;
+}
+
+/** When the current minute of the speculate_budget started, and how much of it is gone */
+static gint64 translate_drafts_minute = 0;
+static gsize translate_drafts_spent = 0;
+
+static void
+translate_draft_cb(const gchar *original_phrase, const gchar *translated_phrase, const gchar *detected_language, const gchar *error_message, gpointer userdata)
+{
+	// The point was to get it into the cache, which translate_phrase() has done
+}
+
+static gboolean
+translate_draft_timeout_cb(gpointer userdata)
+{
+	PurpleConversation *conv = userdata;
+	TranslateConvState *state = translate_conv_state(conv);
+	const gchar *from_lang, *to_lang;
+	gchar *translated_phrase;
+	GArray *spans;
+	gsize cost = 0;
+	gint64 now;
+	guint i;
+	
+	state->draft_timer = 0;
+	
+	from_lang = translate_config.locale->code;
+	to_lang = state->stored_lang;
+	if (state->draft == NULL || !state->node || !state->backend || !to_lang || state->language == translate_config.locale || g_str_equal(to_lang, "auto"))
+		return FALSE;
 	
-	if (g_str_equal(service_to_use, "google"))
+	spans = translate_markup_split(state->draft);
+	if (spans == NULL)
+		return FALSE;
+	
+	// Already have it, most likely from the last time the draft looked like this
+	translated_phrase = translate_markup_lookup(state->backend, state->draft, spans, from_lang, to_lang);
+	if (translated_phrase != NULL)
+	{
+		g_free(translated_phrase);
+		g_array_free(spans, TRUE);
+		return FALSE;
+	}
+	
+	for(i = 0; i < spans->len; i++)
+		if (g_array_index(spans, TranslateSpan, i).translate)
+			cost += g_array_index(spans, TranslateSpan, i).len;
+	
+	now = translate_now_ms();
+	if (now - translate_drafts_minute >= 60000)
 	{
-		google_translate(stripped, from_lang, to_lang, translate_sending_message_cb, convmsg);
-	} else if (g_str_equal(service_to_use, "bing"))
+		translate_drafts_minute = now;
+		translate_drafts_spent = 0;
+	}
+	if (translate_drafts_spent + cost > translate_config.speculate_budget)
 	{
-		bing_translate(stripped, from_lang, to_lang, translate_sending_message_cb, convmsg);
+		purple_debug_info("translate", "Not translating the draft in %s, %" G_GSIZE_FORMAT " characters this minute already\n", conv->name, translate_drafts_spent);
+		translate_drafts_over_budget++;
+		g_array_free(spans, TRUE);
+		return FALSE;
 	}
+	translate_drafts_spent += cost;
+	translate_drafts_sent++;
 	
-	g_free(stripped);
+	// Whatever the last draft still has waiting is out of date now.  Sentences
+	// that haven't changed are answered from the cache or join a request in flight
+	translate_cancel(state, "The draft changed");
+	translate_markup(state->backend, state->draft, spans, from_lang, to_lang, TRANSLATE_PRIORITY_SPECULATIVE, state, translate_draft_cb, NULL);
 	
-	g_free(*message);
-	*message = NULL;
+	return FALSE;
 }
 
-void
-translate_sending_chat_message_cb(const gchar *original_phrase, const gchar *translated_phrase, const gchar *detected_language, gpointer userdata)
+/** Whether anything has emitted translate-draft-changed yet.  Until then there's
+  * nothing to speculate on, so the speculate prefs aren't offered */
+static gboolean translate_drafts_reported = FALSE;
+
+/** The translate-draft-changed signal, emitted by the UI as a message is typed.
+  * The draft is translated into the cache once it stops changing, so that sending
+  * it doesn't have to wait for the translator */
+static void
+translate_draft_changed(PurpleConversation *conv, const gchar *draft, gpointer data)
 {
-	struct TranslateConvMessage *convmsg = userdata;
-	gchar *html_text;
-	int err = 0;
+	TranslateConvState *state;
 	
-	html_text = purple_strdup_withhtml(translated_phrase);
-	err = serv_chat_send(purple_account_get_connection(convmsg->account), purple_conv_chat_get_id(PURPLE_CONV_CHAT(convmsg->conv)), html_text, convmsg->flags);
-	g_free(html_text);
+	translate_drafts_reported = TRUE;
 	
-	html_text = purple_strdup_withhtml(original_phrase);
-	//if (err > 0)
-	//{
-	//	purple_conversation_write(convmsg->conv, convmsg->sender, html_text, convmsg->flags, time(NULL));
-	//}
+	if (!translate_config.speculate || conv == NULL)
+		return;
 	
-	purple_signal_emit(purple_conversations_get_handle(), "sent-chat-msg",
-						convmsg->account, html_text,
-						purple_conv_chat_get_id(PURPLE_CONV_CHAT(convmsg->conv)));
+	if (draft == NULL || *draft == '\0')
+	{
+		translate_draft_clear(conv);
+		return;
+	}
+	
+	state = translate_conv_state(conv);
+	g_free(state->draft);
+	state->draft = g_strdup(draft);
 	
-	g_free(html_text);
-	g_free(convmsg->sender);
-	g_free(convmsg);
+	if (state->draft_timer)
+		purple_timeout_remove(state->draft_timer);
+	state->draft_timer = purple_timeout_add(translate_config.speculate_delay, translate_draft_timeout_cb, conv);
 }
 
-void
-translate_sending_chat_msg(PurpleAccount *account, char **message, int chat_id)
+/** Sends the saved messages that can go now: IMs for accounts that are signed on,
+  * and chat messages for rooms we're in.  account limits it to one account */
+static void
+translate_outbox_resend(PurpleAccount *account)
 {
-	const gchar *from_lang = "";
-	const gchar *service_to_use = "";
-	const gchar *to_lang = "";
-	PurpleChat *chat = NULL;
+	TranslateOutboxEntry *entry;
+	PurpleAccount *entry_account;
 	PurpleConversation *conv;
-	struct TranslateConvMessage *convmsg;
-	gchar *stripped;
+	GList *l, *next;
+	
+	for(l = translate_outbox_saved; l; l = next)
+	{
+		next = l->next;
+		entry = l->data;
+		
+		entry_account = purple_accounts_find(entry->username, entry->protocol_id);
+		if (entry_account != NULL && account != NULL && entry_account != account)
+			continue;
+		if (entry_account != NULL && !purple_account_is_connected(entry_account))
+			continue;
+		
+		conv = NULL;
+		if (entry_account != NULL)
+		{
+			conv = purple_find_conversation_with_account(entry->type, entry->name, entry_account);
+			if (conv == NULL && entry->type == PURPLE_CONV_TYPE_CHAT)
+				continue;
+			if (conv == NULL)
+				conv = purple_conversation_new(PURPLE_CONV_TYPE_IM, entry_account, entry->name);
+		}
+		
+		// Taken off first, as sending it may well put it straight back in the outbox
+		translate_outbox_saved = g_list_delete_link(translate_outbox_saved, l);
+		translate_outbox_changed();
+		
+		if (conv != NULL)
+		{
+			purple_debug_info("translate", "Sending a message to %s saved from last time\n", entry->name);
+			translate_outbox_restored++;
+			purple_conversation_write(conv, NULL, "Sending a message that was still waiting to be translated last time",
+			                          PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG, time(NULL));
+			if (entry->type == PURPLE_CONV_TYPE_CHAT)
+				purple_conv_chat_send(PURPLE_CONV_CHAT(conv), entry->message);
+			else
+				purple_conv_im_send(PURPLE_CONV_IM(conv), entry->message);
+		}
+		
+		// An account that's been deleted since has nowhere to send it
+		translate_outbox_entry_free(entry);
+	}
+}
 
-	from_lang = purple_prefs_get_string("/plugins/core/eionrobb-libpurple-translate/locale");
-	service_to_use = purple_prefs_get_string("/plugins/core/eionrobb-libpurple-translate/service");
-	conv = purple_find_chat(purple_account_get_connection(account), chat_id);
-	if (conv)
-		chat = purple_blist_find_chat(account, conv->name);
-	if (chat)
-		to_lang = purple_blist_node_get_string((PurpleBlistNode *)chat, "eionrobb-translate-lang");
+/** Reads back the messages that were still waiting when we were last closed */
+static void
+translate_outbox_load(void)
+{
+	TranslateOutboxEntry *entry;
+	GKeyFile *keyfile;
+	gchar **groups, *type;
+	gsize i;
 	
-	if (!chat || !service_to_use || !to_lang || g_str_equal(from_lang, to_lang) || g_str_equal(to_lang, "auto"))
+	keyfile = g_key_file_new();
+	if (!g_key_file_load_from_file(keyfile, translate_outbox_filename, G_KEY_FILE_NONE, NULL))
 	{
-		// Don't translate this message
+		g_key_file_free(keyfile);
 		return;
 	}
 	
-	stripped = purple_markup_strip_html(*message);
+	groups = g_key_file_get_groups(keyfile, NULL);
+	for(i = 0; groups[i]; i++)
+	{
+		entry = g_new0(TranslateOutboxEntry, 1);
+		entry->username = g_key_file_get_string(keyfile, groups[i], "account", NULL);
+		entry->protocol_id = g_key_file_get_string(keyfile, groups[i], "protocol", NULL);
+		entry->name = g_key_file_get_string(keyfile, groups[i], "to", NULL);
+		entry->message = g_key_file_get_string(keyfile, groups[i], "message", NULL);
+		type = g_key_file_get_string(keyfile, groups[i], "type", NULL);
+		entry->type = g_strcmp0(type, "chat") == 0 ? PURPLE_CONV_TYPE_CHAT : PURPLE_CONV_TYPE_IM;
+		g_free(type);
+		
+		if (!entry->username || !entry->protocol_id || !entry->name || !entry->message)
+		{
+			translate_outbox_entry_free(entry);
+			continue;
+		}
+		translate_outbox_saved = g_list_append(translate_outbox_saved, entry);
+	}
+	g_strfreev(groups);
+	g_key_file_free(keyfile);
 	
-	convmsg = g_new0(struct TranslateConvMessage, 1);
-	convmsg->account = account;
-	convmsg->conv = conv;
-	convmsg->flags = PURPLE_MESSAGE_SEND;
+	purple_debug_info("translate", "%u outgoing messages saved from last time\n", g_list_length(translate_outbox_saved));
+	translate_outbox_resend(NULL);
+}
+
+/** The release for messages left for next time, which have already been saved */
+static void
+translate_outbox_keep_release(struct TranslateConvMessage *convmsg, const gchar *original_phrase, const gchar *translated_phrase, const gchar *detected_language, const gchar *error_message)
+{
+}
+
+/** Writes out what's still in the outbox and takes it out of our hands, so that
+  * unloading doesn't send it untranslated; it goes next time instead */
+static void
+translate_outbox_keep(void)
+{
+	struct TranslateConvMessage *convmsg;
+	GList *l;
 	
-	if (g_str_equal(service_to_use, "google"))
-	{
-		google_translate(stripped, from_lang, to_lang, translate_sending_chat_message_cb, convmsg);
-	} else if (g_str_equal(service_to_use, "bing"))
+	translate_outbox_write();
+	
+	for(l = translate_outbox; l; l = l->next)
 	{
-		bing_translate(stripped, from_lang, to_lang, translate_sending_chat_message_cb, convmsg);
+		convmsg = l->data;
+		convmsg->outbox = FALSE;
+		convmsg->release = translate_outbox_keep_release;
 	}
+	g_list_free(translate_outbox);
+	translate_outbox = NULL;
 	
-	g_free(stripped);
-	
-	g_free(*message);
-	*message = NULL;
+	g_list_free_full(translate_outbox_saved, translate_outbox_entry_free);
+	translate_outbox_saved = NULL;
+}
+
+static void
+translate_signed_on(PurpleConnection *gc)
+{
+	translate_outbox_resend(purple_connection_get_account(gc));
+}
+
+static void
+translate_chat_joined(PurpleConversation *conv)
+{
+	translate_outbox_resend(purple_conversation_get_account(conv));
 }
 
 static void
-translate_action_blist_cb(PurpleBlistNode *node, PurpleKeyValuePair *pair)
+translate_action_blist_cb(PurpleBlistNode *node, const TranslateLanguage *language)
 {
 	PurpleConversation *conv = NULL;
 	gchar *message;
@@ -602,10 +5940,10 @@ translate_action_blist_cb(PurpleBlistNode *node, PurpleKeyValuePair *pair)
 	PurpleContact *contact;
 	PurpleBuddy *buddy;
 
-	if (pair == NULL)
+	if (language == NULL)
 		purple_blist_node_set_string(node, "eionrobb-translate-lang", NULL);
 	else
-		purple_blist_node_set_string(node, "eionrobb-translate-lang", pair->key);
+		purple_blist_node_set_string(node, "eionrobb-translate-lang", language->code);
 	
 	switch(node->type)
 	{
@@ -630,9 +5968,11 @@ translate_action_blist_cb(PurpleBlistNode *node, PurpleKeyValuePair *pair)
 			break;
 	}
 	
-	if (conv != NULL && pair != NULL)
+	translate_conv_state_invalidate(conv);
+	
+	if (conv != NULL && language != NULL)
 	{
-		message = g_strdup_printf("Now translating to %s", (const gchar *)pair->value);
+		message = g_strdup_printf("Now translating to %s", language->name);
 		purple_conversation_write(conv, NULL, message, PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG, time(NULL));
 		g_free(message);
 	}
@@ -644,8 +5984,7 @@ translate_extended_menu(PurpleBlistNode *node, GList **menu, PurpleCallback call
 	const gchar *stored_lang;
 	GList *menu_children = NULL;
 	PurpleMenuAction *action;
-	PurpleKeyValuePair *pair;
-	GList *l;
+	guint i;
 	
 	if (!node)
 		return;
@@ -660,12 +5999,12 @@ translate_extended_menu(PurpleBlistNode *node, GList **menu, PurpleCallback call
 	// Spacer
 	menu_children = g_list_append(menu_children, NULL);
 	
-	for(l = supported_languages; l; l = l->next)
+	for(i = 0; i < G_N_ELEMENTS(translate_languages); i++)
 	{
-		pair = (PurpleKeyValuePair *) l->data;
-		action = purple_menu_action_new(pair->value, callback, pair, NULL);
-		menu_children = g_list_append(menu_children, action);
+		action = purple_menu_action_new(translate_languages[i].name, callback, (gpointer) &translate_languages[i], NULL);
+		menu_children = g_list_prepend(menu_children, action);
 	}
+	menu_children = g_list_reverse(menu_children);
 	
 	// Create the menu for the languages
 	action = purple_menu_action_new("Translate to...", NULL, NULL, menu_children);
@@ -679,23 +6018,21 @@ translate_blist_extended_menu(PurpleBlistNode *node, GList **menu)
 }
 
 static void
-translate_action_conv_cb(PurpleConversation *conv, PurpleKeyValuePair *pair)
+translate_action_conv_cb(PurpleConversation *conv, const TranslateLanguage *language)
 {
-	PurpleBlistNode *node = NULL;
+	PurpleBlistNode *node;
 	gchar *message;
 	
-	if (conv->type == PURPLE_CONV_TYPE_IM)
-		node = (PurpleBlistNode *) purple_find_buddy(conv->account, conv->name);
-	else if (conv->type == PURPLE_CONV_TYPE_CHAT)
-		node = (PurpleBlistNode *) purple_blist_find_chat(conv->account, conv->name);
+	node = translate_conv_state(conv)->node;
 	
 	if (node != NULL)
 	{
-		translate_action_blist_cb(node, pair);
+		translate_action_blist_cb(node, language);
+		translate_conv_state_invalidate(conv);
 		
-		if (pair != NULL)
+		if (language != NULL)
 		{
-			message = g_strdup_printf("Now translating to %s", (const gchar *)pair->value);
+			message = g_strdup_printf("Now translating to %s", language->name);
 			purple_conversation_write(conv, NULL, message, PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG, time(NULL));
 			g_free(message);
 		}
@@ -705,23 +6042,22 @@ translate_action_conv_cb(PurpleConversation *conv, PurpleKeyValuePair *pair)
 static void
 translate_conversation_created(PurpleConversation *conv)
 {
-	PurpleBlistNode *node = NULL;
+	TranslateConvState *state;
 	gchar *message;
 	const gchar *language_key;
 	const gchar *language_name;
 	
-	if (conv->type == PURPLE_CONV_TYPE_IM)
-		node = (PurpleBlistNode *) purple_find_buddy(conv->account, conv->name);
-	else if (conv->type == PURPLE_CONV_TYPE_CHAT)
-		node = (PurpleBlistNode *) purple_blist_find_chat(conv->account, conv->name);
+	state = translate_conv_state(conv);
 	
-	if (node != NULL)
+	if (state->node != NULL)
 	{
-		language_key = purple_blist_node_get_string(node, "eionrobb-translate-lang");
+		language_key = state->stored_lang;
 		
 		if (language_key != NULL)
 		{
 			language_name = get_language_name(language_key);
+			if (language_name == NULL)
+				language_name = language_key;
 		
 			message = g_strdup_printf("Now translating to %s", language_name);
 			purple_conversation_write(conv, NULL, message, PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG, time(NULL));
@@ -730,27 +6066,83 @@ translate_conversation_created(PurpleConversation *conv)
 	}
 }
 
+static void
+translate_deleting_conversation(PurpleConversation *conv)
+{
+	translate_conv_state_free(conv);
+	
+	// Nothing a room says can be shown once we've left it, so stop translating it.
+	// IMs carry on, as their messages open a new conversation or still get sent
+	if (conv->type == PURPLE_CONV_TYPE_CHAT)
+		translate_cancel(conv, "The conversation was closed");
+}
+
+static void
+translate_blist_node_changed(PurpleBlistNode *node)
+{
+	// Rare enough that it's not worth finding which conversations it affects
+	translate_conv_generation++;
+}
+
 static void
 translate_conv_extended_menu(PurpleConversation *conv, GList **menu)
 {
-	PurpleBlistNode *node = NULL;
+	PurpleBlistNode *node;
 	
-	if (conv->type == PURPLE_CONV_TYPE_IM)
-		node = (PurpleBlistNode *) purple_find_buddy(conv->account, conv->name);
-	else if (conv->type == PURPLE_CONV_TYPE_CHAT)
-		node = (PurpleBlistNode *) purple_blist_find_chat(conv->account, conv->name);
+	node = translate_conv_state(conv)->node;
 	
 	if (node != NULL)
 		translate_extended_menu(node, menu, (PurpleCallback)translate_action_conv_cb);
 }
 
+/** Refreshes translate_config from the prefs */
+static void
+translate_config_load(void)
+{
+	translate_config.backend = translate_backend_find(purple_prefs_get_string("/plugins/core/eionrobb-libpurple-translate/service"));
+	translate_config.fallback = translate_backend_find(purple_prefs_get_string("/plugins/core/eionrobb-libpurple-translate/fallback_service"));
+	translate_config.locale = translate_language_find(purple_prefs_get_string("/plugins/core/eionrobb-libpurple-translate/locale"));
+	if (translate_config.locale == NULL)
+		translate_config.locale = translate_language_find("en");
+	
+	translate_config.cache_size = (gsize) MAX(purple_prefs_get_int("/plugins/core/eionrobb-libpurple-translate/cache_size"), 0) * 1024;
+	translate_config.store_size = (gsize) MAX(purple_prefs_get_int("/plugins/core/eionrobb-libpurple-translate/store_size"), 1) * 1024;
+	translate_config.batch_window = purple_prefs_get_int("/plugins/core/eionrobb-libpurple-translate/batch_window");
+	translate_config.batch_size = MAX(purple_prefs_get_int("/plugins/core/eionrobb-libpurple-translate/batch_size"), 1);
+	translate_config.detect_confidence = purple_prefs_get_int("/plugins/core/eionrobb-libpurple-translate/detect_confidence");
+	translate_config.http_max_connections = MAX(purple_prefs_get_int("/plugins/core/eionrobb-libpurple-translate/http_max_connections"), 1);
+	translate_config.http_idle_timeout = MAX(purple_prefs_get_int("/plugins/core/eionrobb-libpurple-translate/http_idle_timeout"), 1);
+	translate_config.max_in_flight = MAX(purple_prefs_get_int("/plugins/core/eionrobb-libpurple-translate/max_in_flight"), 1);
+	translate_config.request_timeout = MAX(purple_prefs_get_int("/plugins/core/eionrobb-libpurple-translate/request_timeout"), 1);
+	translate_config.hedge_delay = MAX(purple_prefs_get_int("/plugins/core/eionrobb-libpurple-translate/hedge_delay"), 0);
+	translate_config.reorder_timeout = MAX(purple_prefs_get_int("/plugins/core/eionrobb-libpurple-translate/reorder_timeout"), 1);
+	translate_config.speculate = purple_prefs_get_bool("/plugins/core/eionrobb-libpurple-translate/speculate");
+	translate_config.speculate_delay = MAX(purple_prefs_get_int("/plugins/core/eionrobb-libpurple-translate/speculate_delay"), 1);
+	translate_config.speculate_budget = MAX(purple_prefs_get_int("/plugins/core/eionrobb-libpurple-translate/speculate_budget"), 0);
+	translate_config.mock_latency = purple_prefs_get_int("/plugins/core/eionrobb-libpurple-translate/mock_latency");
+	translate_config.mock_error_rate = purple_prefs_get_int("/plugins/core/eionrobb-libpurple-translate/mock_error_rate");
+}
+
+static void
+translate_config_changed_cb(const char *name, PurplePrefType type, gconstpointer val, gpointer data)
+{
+	purple_debug_info("translate", "%s changed, reloading settings\n", name);
+	
+	translate_config_load();
+	translate_conv_generation++;
+	
+	// Shrinking the cache takes effect straight away rather than on the next insert
+	translate_cache_trim();
+}
+
 static PurplePluginPrefFrame *
 plugin_config_frame(PurplePlugin *plugin)
 {
 	PurplePluginPrefFrame *frame;
 	PurplePluginPref *ppref;
 	GList *l = NULL;
-	PurpleKeyValuePair *pair;
+	TranslateBackend *backend;
+	guint i;
 	
 	frame = purple_plugin_pref_frame_new();
 	
@@ -759,11 +6151,8 @@ plugin_config_frame(PurplePlugin *plugin)
 		"My language:");
 	purple_plugin_pref_set_type(ppref, PURPLE_PLUGIN_PREF_CHOICE);
 	
-	for(l = supported_languages; l; l = l->next)
-	{
-		pair = (PurpleKeyValuePair *) l->data;
-		purple_plugin_pref_add_choice(ppref, pair->value, pair->key);
-	}
+	for(i = 0; i < G_N_ELEMENTS(translate_languages); i++)
+		purple_plugin_pref_add_choice(ppref, translate_languages[i].name, (gpointer) translate_languages[i].code);
 	
 	purple_plugin_pref_frame_add(frame, ppref);
 	
@@ -773,8 +6162,146 @@ plugin_config_frame(PurplePlugin *plugin)
 		"Use service:");
 	purple_plugin_pref_set_type(ppref, PURPLE_PLUGIN_PREF_CHOICE);
 	
-	purple_plugin_pref_add_choice(ppref, "Google Translate", "google");
-	purple_plugin_pref_add_choice(ppref, "Microsoft Translator", "bing");
+	for(l = translate_backends; l; l = l->next)
+	{
+		backend = l->data;
+		purple_plugin_pref_add_choice(ppref, backend->name, (gpointer) backend->id);
+	}
+	
+	purple_plugin_pref_frame_add(frame, ppref);
+	
+	ppref = purple_plugin_pref_new_with_name_and_label(
+		"/plugins/core/eionrobb-libpurple-translate/fallback_service",
+		"For phrases not in the phrase table, use:");
+	purple_plugin_pref_set_type(ppref, PURPLE_PLUGIN_PREF_CHOICE);
+	
+	purple_plugin_pref_add_choice(ppref, "Nothing (leave them untranslated)", (gpointer) "none");
+	for(l = translate_backends; l; l = l->next)
+	{
+		backend = l->data;
+		if (backend->lookup == NULL)
+			purple_plugin_pref_add_choice(ppref, backend->name, (gpointer) backend->id);
+	}
+	
+	purple_plugin_pref_frame_add(frame, ppref);
+	
+	ppref = purple_plugin_pref_new_with_name_and_label(
+		"/plugins/core/eionrobb-libpurple-translate/cache_size",
+		"Translation cache size (KB):");
+	purple_plugin_pref_set_bounds(ppref, 0, 65536);
+	
+	purple_plugin_pref_frame_add(frame, ppref);
+	
+	ppref = purple_plugin_pref_new_with_name_and_label(
+		"/plugins/core/eionrobb-libpurple-translate/store_size",
+		"Saved translations size (KB):");
+	purple_plugin_pref_set_bounds(ppref, 16, 1048576);
+	
+	purple_plugin_pref_frame_add(frame, ppref);
+	
+	ppref = purple_plugin_pref_new_with_name_and_label(
+		"/plugins/core/eionrobb-libpurple-translate/batch_window",
+		"Wait for more messages to send together (ms):");
+	purple_plugin_pref_set_bounds(ppref, 0, 5000);
+	
+	purple_plugin_pref_frame_add(frame, ppref);
+	
+	ppref = purple_plugin_pref_new_with_name_and_label(
+		"/plugins/core/eionrobb-libpurple-translate/batch_size",
+		"Most messages to send together:");
+	purple_plugin_pref_set_bounds(ppref, 1, 50);
+	
+	purple_plugin_pref_frame_add(frame, ppref);
+	
+	ppref = purple_plugin_pref_new_with_name_and_label(
+		"/plugins/core/eionrobb-libpurple-translate/detect_confidence",
+		"Detect languages locally when this sure (%, 101 to disable):");
+	purple_plugin_pref_set_bounds(ppref, 0, 101);
+	
+	purple_plugin_pref_frame_add(frame, ppref);
+	
+	ppref = purple_plugin_pref_new_with_name_and_label(
+		"/plugins/core/eionrobb-libpurple-translate/http_max_connections",
+		"Connections per translation server:");
+	purple_plugin_pref_set_bounds(ppref, 1, 16);
+	
+	purple_plugin_pref_frame_add(frame, ppref);
+	
+	ppref = purple_plugin_pref_new_with_name_and_label(
+		"/plugins/core/eionrobb-libpurple-translate/http_idle_timeout",
+		"Keep idle connections open for (seconds):");
+	purple_plugin_pref_set_bounds(ppref, 1, 3600);
+	
+	purple_plugin_pref_frame_add(frame, ppref);
+	
+	ppref = purple_plugin_pref_new_with_name_and_label(
+		"/plugins/core/eionrobb-libpurple-translate/max_in_flight",
+		"Requests to have waiting at once:");
+	purple_plugin_pref_set_bounds(ppref, 1, 64);
+	
+	purple_plugin_pref_frame_add(frame, ppref);
+	
+	ppref = purple_plugin_pref_new_with_name_and_label(
+		"/plugins/core/eionrobb-libpurple-translate/request_timeout",
+		"Give up on a request after (ms):");
+	purple_plugin_pref_set_bounds(ppref, 1000, 600000);
+	
+	purple_plugin_pref_frame_add(frame, ppref);
+	
+	ppref = purple_plugin_pref_new_with_name_and_label(
+		"/plugins/core/eionrobb-libpurple-translate/hedge_delay",
+		"Also ask the other service after (ms, 0 for never):");
+	purple_plugin_pref_set_bounds(ppref, 0, 600000);
+	
+	purple_plugin_pref_frame_add(frame, ppref);
+	
+	ppref = purple_plugin_pref_new_with_name_and_label(
+		"/plugins/core/eionrobb-libpurple-translate/reorder_timeout",
+		"Stop a slow message holding up later ones after (ms):");
+	purple_plugin_pref_set_bounds(ppref, 100, 600000);
+	
+	purple_plugin_pref_frame_add(frame, ppref);
+	
+	// Drafts only come from a UI that emits translate-draft-changed, which Pidgin
+	// doesn't, so don't offer settings that would do nothing
+	if (translate_drafts_reported)
+	{
+		ppref = purple_plugin_pref_new_with_name_and_label(
+			"/plugins/core/eionrobb-libpurple-translate/speculate",
+			"Translate messages while they're being typed");
+		
+		purple_plugin_pref_frame_add(frame, ppref);
+		
+		ppref = purple_plugin_pref_new_with_name_and_label(
+			"/plugins/core/eionrobb-libpurple-translate/speculate_delay",
+			"Translate a draft once it's unchanged for (ms):");
+		purple_plugin_pref_set_bounds(ppref, 100, 60000);
+		
+		purple_plugin_pref_frame_add(frame, ppref);
+		
+		ppref = purple_plugin_pref_new_with_name_and_label(
+			"/plugins/core/eionrobb-libpurple-translate/speculate_budget",
+			"Characters of drafts to translate a minute:");
+		purple_plugin_pref_set_bounds(ppref, 0, 100000);
+		
+		purple_plugin_pref_frame_add(frame, ppref);
+	} else {
+		ppref = purple_plugin_pref_new_with_label(
+			"Translating messages while they're being typed needs a UI that reports drafts (translate-draft-changed); this one doesn't");
+		purple_plugin_pref_frame_add(frame, ppref);
+	}
+	
+	ppref = purple_plugin_pref_new_with_name_and_label(
+		"/plugins/core/eionrobb-libpurple-translate/mock_latency",
+		"Test backend latency (ms):");
+	purple_plugin_pref_set_bounds(ppref, 0, 60000);
+	
+	purple_plugin_pref_frame_add(frame, ppref);
+	
+	ppref = purple_plugin_pref_new_with_name_and_label(
+		"/plugins/core/eionrobb-libpurple-translate/mock_error_rate",
+		"Test backend failure rate (%):");
+	purple_plugin_pref_set_bounds(ppref, 0, 100);
 	
 	purple_plugin_pref_frame_add(frame, ppref);
 	
@@ -788,88 +6315,68 @@ init_plugin(PurplePlugin *plugin)
 	languages = g_get_language_names();
 	const gchar *language;
 	guint i = 0;
-	PurpleKeyValuePair *pair;
 	
+	translate_languages_init();
+	
+	// Default to the first of the user's locales that we can translate
 	while((language = languages[i++]))
-		if (language && strlen(language) == 2)
+		if (strlen(language) >= 2 && translate_language_find(language))
 			break;
-	if (!language || strlen(language) != 2)
+	if (language == NULL)
 		language = "en";
+	else
+		language = translate_language_canonical(language);
 	
 	purple_prefs_add_none("/plugins/core/eionrobb-libpurple-translate");
 	purple_prefs_add_string("/plugins/core/eionrobb-libpurple-translate/locale", language);
 	purple_prefs_add_string("/plugins/core/eionrobb-libpurple-translate/service", "google");
+	purple_prefs_add_string("/plugins/core/eionrobb-libpurple-translate/fallback_service", "google");
+	purple_prefs_add_int("/plugins/core/eionrobb-libpurple-translate/cache_size", 512);
+	purple_prefs_add_int("/plugins/core/eionrobb-libpurple-translate/store_size", 4096);
+	purple_prefs_add_int("/plugins/core/eionrobb-libpurple-translate/batch_window", 150);
+	purple_prefs_add_int("/plugins/core/eionrobb-libpurple-translate/batch_size", 10);
+	purple_prefs_add_int("/plugins/core/eionrobb-libpurple-translate/detect_confidence", 60);
+	purple_prefs_add_int("/plugins/core/eionrobb-libpurple-translate/reorder_timeout", 5000);
+	purple_prefs_add_int("/plugins/core/eionrobb-libpurple-translate/mock_latency", 300);
+	purple_prefs_add_int("/plugins/core/eionrobb-libpurple-translate/mock_error_rate", 0);
+	purple_prefs_add_int("/plugins/core/eionrobb-libpurple-translate/http_max_connections", 4);
+	purple_prefs_add_int("/plugins/core/eionrobb-libpurple-translate/http_idle_timeout", 60);
+	purple_prefs_add_int("/plugins/core/eionrobb-libpurple-translate/max_in_flight", 6);
+	purple_prefs_add_int("/plugins/core/eionrobb-libpurple-translate/request_timeout", 20000);
+	purple_prefs_add_int("/plugins/core/eionrobb-libpurple-translate/hedge_delay", 0);
+	purple_prefs_add_bool("/plugins/core/eionrobb-libpurple-translate/speculate", FALSE);
+	purple_prefs_add_int("/plugins/core/eionrobb-libpurple-translate/speculate_delay", 700);
+	purple_prefs_add_int("/plugins/core/eionrobb-libpurple-translate/speculate_budget", 2000);
 	
-#define add_language(label, code) \
-	pair = g_new0(PurpleKeyValuePair, 1); \
-	pair->key = g_strdup(code); \
-	pair->value = g_strdup(label); \
-	supported_languages = g_list_append(supported_languages, pair);
-	
-	add_language("Afrikaans", "af");
-	add_language("Albanian", "sq");
-	add_language("Arabic", "ar");
-	add_language("Armenian", "hy");
-	add_language("Azerbaijani", "az");
-	add_language("Basque", "eu");
-	add_language("Belarusian", "be");
-	add_language("Bulgarian", "bg");
-	add_language("Catalan", "ca");
-	add_language("Chinese (Simplified)", "zh-CN");
-	add_language("Chinese (Traditional)", "zh-TW");
-	add_language("Croatian", "hr");
-	add_language("Czech", "cs");
-	add_language("Danish", "da");
-	add_language("Dutch", "nl");
-	add_language("English", "en");
-	add_language("Estonian", "et");
-	add_language("Filipino", "tl");
-	add_language("Finnish", "fi");
-	add_language("French", "fr");
-	add_language("Galician", "gl");
-	add_language("Georgian", "ka");
-	add_language("German", "de");
-	add_language("Greek", "el");
-	add_language("Haitian Creole", "ht");
-	add_language("Hebrew", "iw");
-	add_language("Hindi", "hi");
-	add_language("Hungarian", "hu");
-	add_language("Icelandic", "is");
-	add_language("Indonesian", "id");
-	add_language("Irish", "ga");
-	add_language("Italian", "it");
-	add_language("Japanese", "ja");
-	add_language("Korean", "ko");
-	add_language("Latin", "la");
-	add_language("Latvian", "lv");
-	add_language("Lithuanian", "lt");
-	add_language("Macedonian", "mk");
-	add_language("Malay", "ms");
-	add_language("Maltese", "mt");
-	add_language("Norwegian", "no");
-	add_language("Persian", "fa");
-	add_language("Polish", "pl");
-	add_language("Portuguese", "pt");
-	add_language("Romanian", "ro");
-	add_language("Russian", "ru");
-	add_language("Serbian", "sr");
-	add_language("Slovak", "sk");
-	add_language("Slovenian", "sl");
-	add_language("Spanish", "es");
-	add_language("Swahili", "sw");
-	add_language("Swedish", "sv");
-	add_language("Thai", "th");
-	add_language("Turkish", "tr");
-	add_language("Ukrainian", "uk");
-	add_language("Urdu", "ur");
-	add_language("Vietnamese", "vi");
-	add_language("Welsh", "cy");
-	add_language("Yiddish", "yi");
+	// The translation memory itself is only opened on the first lookup
+	translate_db_filename = g_build_filename(purple_user_dir(), "translate-memory.db", NULL);
+	translate_phrases_filename = g_build_filename(purple_user_dir(), "translate-phrases.db", NULL);
+	translate_outbox_filename = g_build_filename(purple_user_dir(), "translate-outbox.ini", NULL);
 }
 
 static gboolean
 plugin_load(PurplePlugin *plugin)
 {
+	translate_plugin = plugin;
+	
+	// libpurple has no signal for our own typing, only the other side's, so the UI
+	// (or a plugin for it) tells us about drafts with
+	// purple_signal_emit(plugin, "translate-draft-changed", conv, text)
+	purple_signal_register(plugin, "translate-draft-changed",
+	                       purple_marshal_VOID__POINTER_POINTER, NULL, 2,
+	                       purple_value_new(PURPLE_TYPE_SUBTYPE, PURPLE_SUBTYPE_CONVERSATION),
+	                       purple_value_new(PURPLE_TYPE_STRING));
+	
+	translate_backend_register(&google_backend);
+	translate_backend_register(&bing_backend);
+	translate_backend_register(&mock_backend);
+	translate_backend_register(&offline_backend);
+	
+	// Watching the parent hears about every pref under it
+	translate_config_load();
+	purple_prefs_connect_callback(plugin, "/plugins/core/eionrobb-libpurple-translate",
+	                              translate_config_changed_cb, NULL);
+	
 	purple_signal_connect(purple_conversations_get_handle(),
 	                      "receiving-im-msg", plugin,
 	                      PURPLE_CALLBACK(translate_receiving_im_msg), NULL);
@@ -885,18 +6392,42 @@ plugin_load(PurplePlugin *plugin)
 	purple_signal_connect(purple_conversations_get_handle(),
 						  "conversation-created", plugin,
 						  PURPLE_CALLBACK(translate_conversation_created), NULL);
+	purple_signal_connect(purple_conversations_get_handle(),
+						  "deleting-conversation", plugin,
+						  PURPLE_CALLBACK(translate_deleting_conversation), NULL);
+	purple_signal_connect(purple_blist_get_handle(),
+						  "blist-node-added", plugin,
+						  PURPLE_CALLBACK(translate_blist_node_changed), NULL);
+	purple_signal_connect(purple_blist_get_handle(),
+						  "blist-node-removed", plugin,
+						  PURPLE_CALLBACK(translate_blist_node_changed), NULL);
 	purple_signal_connect(purple_conversations_get_handle(),
 	                      "receiving-chat-msg", plugin,
 	                      PURPLE_CALLBACK(translate_receiving_chat_msg), NULL);
 	purple_signal_connect(purple_conversations_get_handle(),
 	                      "sending-chat-msg", plugin,
 	                      PURPLE_CALLBACK(translate_sending_chat_msg), NULL);
+	purple_signal_connect(plugin,
+	                      "translate-draft-changed", plugin,
+	                      PURPLE_CALLBACK(translate_draft_changed), NULL);
+	purple_signal_connect(purple_connections_get_handle(),
+	                      "signed-on", plugin,
+	                      PURPLE_CALLBACK(translate_signed_on), NULL);
+	purple_signal_connect(purple_conversations_get_handle(),
+	                      "chat-joined", plugin,
+	                      PURPLE_CALLBACK(translate_chat_joined), NULL);
+	
+	// Anything left over from last time goes once its account or room is back
+	translate_outbox_load();
+	
 	return TRUE;
 }
 
 static gboolean
 plugin_unload(PurplePlugin *plugin)
 {
+	GList *l;
+	
 	purple_signal_disconnect(purple_conversations_get_handle(),
 	                         "receiving-im-msg", plugin,
 	                         PURPLE_CALLBACK(translate_receiving_im_msg));
@@ -912,15 +6443,168 @@ plugin_unload(PurplePlugin *plugin)
 	purple_signal_disconnect(purple_conversations_get_handle(),
 							 "conversation-created", plugin,
 							 PURPLE_CALLBACK(translate_conversation_created));
+	purple_signal_disconnect(purple_conversations_get_handle(),
+							 "deleting-conversation", plugin,
+							 PURPLE_CALLBACK(translate_deleting_conversation));
+	purple_signal_disconnect(purple_blist_get_handle(),
+							 "blist-node-added", plugin,
+							 PURPLE_CALLBACK(translate_blist_node_changed));
+	purple_signal_disconnect(purple_blist_get_handle(),
+							 "blist-node-removed", plugin,
+							 PURPLE_CALLBACK(translate_blist_node_changed));
 	purple_signal_disconnect(purple_conversations_get_handle(),
 	                         "receiving-chat-msg", plugin,
 	                         PURPLE_CALLBACK(translate_receiving_chat_msg));
 	purple_signal_disconnect(purple_conversations_get_handle(),
 	                         "sending-chat-msg", plugin,
 	                         PURPLE_CALLBACK(translate_sending_chat_msg));
+	purple_signal_disconnect(plugin,
+	                         "translate-draft-changed", plugin,
+	                         PURPLE_CALLBACK(translate_draft_changed));
+	purple_signal_disconnect(purple_connections_get_handle(),
+	                         "signed-on", plugin,
+	                         PURPLE_CALLBACK(translate_signed_on));
+	purple_signal_disconnect(purple_conversations_get_handle(),
+	                         "chat-joined", plugin,
+	                         PURPLE_CALLBACK(translate_chat_joined));
+	purple_signals_unregister_by_instance(plugin);
+	
+	purple_prefs_disconnect_by_handle(plugin);
+	
+	// Finish off everything still going while its conversations are still there,
+	// so that no message is lost and nothing calls back once we're gone
+	translate_deliveries_flush();
+	translate_outbox_keep();
+	translate_cancel(NULL, "The translation plugin was unloaded");
+	
+	for(l = purple_get_conversations(); l; l = l->next)
+		translate_conv_state_free(l->data);
+	
+	if (translate_conv_orphans_timer)
+		purple_timeout_remove(translate_conv_orphans_timer);
+	translate_conv_orphans_cb(NULL);
+	
+	translate_backend_unregister(&google_backend);
+	translate_backend_unregister(&bing_backend);
+	translate_backend_unregister(&mock_backend);
+	translate_backend_unregister(&offline_backend);
+	
+	translate_scheduler_shutdown();
+	translate_http_shutdown();
+	
+	purple_debug_info("translate", "Cache hits %u, misses %u, evictions %u\n",
+					translate_cache_hits, translate_cache_misses, translate_cache_evictions);
+	translate_cache_clear();
+	translate_db_close();
+	translate_phrases_close();
+	if (translate_language_trigrams != NULL)
+		g_hash_table_destroy(translate_language_trigrams);
+	translate_language_trigrams = NULL;
+	if (translate_inflight != NULL)
+		g_hash_table_destroy(translate_inflight);
+	translate_inflight = NULL;
+	translate_pools_clear();
+	
 	return TRUE;
 }
 
+static guint
+translate_scheduler_average_wait(TranslatePriority priority)
+{
+	if (!translate_scheduler_dispatched[priority])
+		return 0;
+	
+	return (guint) (translate_scheduler_wait_ms[priority] / translate_scheduler_dispatched[priority]);
+}
+
+static void
+translate_action_show_stats(PurplePluginAction *action)
+{
+	gchar *stats;
+	
+	stats = g_strdup_printf("<b>Cache</b><br>"
+				"Entries: %u (%" G_GSIZE_FORMAT " bytes)<br>"
+				"Hits: %u<br>"
+				"Misses: %u<br>"
+				"Evictions: %u<br>"
+				"Joined in-flight requests: %u<br>"
+				"Requests reused from the pool: %u<br>"
+				"<br><b>Saved translations</b><br>"
+				"Entries: %u (%" G_GSIZE_FORMAT " bytes)<br>"
+				"Hits: %u<br>"
+				"<br><b>Phrase table</b><br>"
+				"Entries: %u<br>"
+				"Hits: %u<br>"
+				"Misses: %u<br>"
+				"<br><b>Requests</b><br>"
+				"Sent: %u<br>"
+				"Messages sent: %u<br>"
+				"HTTP requests: %u (%u POSTed, %u couldn't be made, %u phrases too long to send)<br>"
+				"Connections opened: %u<br>"
+				"Response bytes received: %" G_GUINT64_FORMAT " (%" G_GUINT64_FORMAT " decompressed)<br>"
+				"Messages not worth translating: %u<br>"
+				"Spans kept as they were: %u<br>"
+				"Messages sent a sentence at a time: %u<br>"
+				"Chat messages from a sender whose language we knew: %u<br>"
+				"Chat senders forgotten: %u<br>"
+				"<br><b>Scheduler</b><br>"
+				"In flight: %u<br>"
+				"Queued (outgoing/IM/chat): %u/%u/%u<br>"
+				"Longest queue (outgoing/IM/chat): %u/%u/%u<br>"
+				"Average wait in ms (outgoing/IM/chat): %u/%u/%u<br>"
+				"Held back by rate limits: %u<br>"
+				"Timed out: %u<br>"
+				"Phrases cancelled: %u<br>"
+				"Retried: %u (gave up on %u, not worth retrying %u)<br>"
+				"Services shut off after failing: %u<br>"
+				"Phrases not sent while a service was off: %u<br>"
+				"Messages sent from last time: %u<br>"
+				"Hedged: %u (won %u)<br>"
+				"<br><b>Drafts</b><br>"
+				"Translated while being typed: %u<br>"
+				"Over the budget: %u<br>"
+				"Sent without waiting: %u<br>",
+				translate_cache ? g_hash_table_size(translate_cache) : 0, translate_cache_size,
+				translate_cache_hits, translate_cache_misses, translate_cache_evictions,
+				translate_inflight_joined,
+				translate_pool_reused,
+				translate_db_index ? g_hash_table_size(translate_db_index) + g_hash_table_size(translate_db_collisions) : 0, translate_db_length,
+				translate_db_hits,
+				translate_phrases_count, translate_phrases_hits, translate_phrases_misses,
+				translate_batches_sent, translate_batched_phrases,
+				translate_http_requests_sent, translate_http_posts_sent, translate_requests_unsendable, translate_requests_too_long,
+				translate_http_connections_opened,
+				translate_http_bytes_received, translate_http_bytes_decoded,
+				translate_fast_path_messages, translate_masked_spans, translate_split_messages,
+				translate_chat_senders_known, translate_chat_senders_forgotten,
+				translate_scheduler_inflight,
+				translate_scheduler_depth[TRANSLATE_PRIORITY_OUTGOING], translate_scheduler_depth[TRANSLATE_PRIORITY_IM], translate_scheduler_depth[TRANSLATE_PRIORITY_CHAT],
+				translate_scheduler_max_depth[TRANSLATE_PRIORITY_OUTGOING], translate_scheduler_max_depth[TRANSLATE_PRIORITY_IM], translate_scheduler_max_depth[TRANSLATE_PRIORITY_CHAT],
+				translate_scheduler_average_wait(TRANSLATE_PRIORITY_OUTGOING), translate_scheduler_average_wait(TRANSLATE_PRIORITY_IM), translate_scheduler_average_wait(TRANSLATE_PRIORITY_CHAT),
+				translate_scheduler_throttled,
+				translate_requests_timed_out,
+				translate_stores_cancelled,
+				translate_retries_sent, translate_retries_exhausted, translate_retries_unwanted,
+				translate_breaker_trips, translate_breaker_rejected,
+				translate_outbox_restored,
+				translate_hedges_sent, translate_hedges_won,
+				translate_drafts_sent, translate_drafts_over_budget, translate_drafts_used);
+	
+	purple_notify_formatted(action->plugin, "Translation statistics", "Translation statistics", NULL, stats, NULL, NULL);
+	
+	g_free(stats);
+}
+
+static GList *
+plugin_actions(PurplePlugin *plugin, gpointer context)
+{
+	GList *actions = NULL;
+	
+	actions = g_list_append(actions, purple_plugin_action_new("Translation statistics", translate_action_show_stats));
+	
+	return actions;
+}
+
 static PurplePluginUiInfo prefs_info = {
 	plugin_config_frame,
 	0,
@@ -957,7 +6641,7 @@ static PurplePluginInfo info = {
     NULL,
     NULL,
     &prefs_info,
-    NULL
+    plugin_actions
 };
 
 PURPLE_INIT_PLUGIN(translate, init_plugin, info);